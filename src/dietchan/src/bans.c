@@ -23,115 +23,119 @@ int ban_matches_board(struct ban *ban, uint64 board_id)
 }
 
 
-void find_bans(struct ip *ip, find_bans_callback callback, void *extra)
-{
-	struct ip_range range = {0};
-	range.ip = *ip;
-
-	switch (ip->version) {
-		case IP_V4: range.range =  32; break;
-		case IP_V6: range.range = 128; break;
-	}
+struct find_bans_info {
+	struct ip *ip;
+	find_bans_callback callback;
+	void *extra;
+};
 
-	while (range.range >= 0) {
-		for (struct ban *ban = db_hashmap_get(&ban_tbl, &range); ban; ban=ban_next_in_bucket(ban)) {
-			if (ban_enabled(ban)) {
-				callback(ban, ip, extra);
-			}
+static void find_bans_callback_range(void *val, void *extra)
+{
+	struct find_bans_info *info = (struct find_bans_info*)extra;
+	for (struct ban *ban = (struct ban*)val; ban && !read_outdated(); ban=ban_next_in_bucket(ban)) {
+		if (ban_enabled(ban)) {
+			info->callback(ban, info->ip, info->extra);
 		}
-		--(range.range);
 	}
 }
 
-struct is_banned_info {
-	enum ban_target target;
-	enum ban_type type;
-	int64 expires;
+void find_bans(struct ip *ip, find_bans_callback callback, void *extra)
+{
+	struct find_bans_info info = {ip, callback, extra};
+	db_iptrie_find(&ban_trie, ip, find_bans_callback_range, &info);
+}
+
+struct evaluate_bans_info {
+	uint64 now;
 	struct board *board;
+	enum ban_target target;
+	struct ban_verdict *verdict;
 };
 
-static void is_banned_callback(struct ban *ban, struct ip *ip, void *extra)
+// Extends until by the expiry of the ban, -1 for ever
+static void extend_until(int64 *until, struct ban *ban)
 {
-	uint64 now = time(NULL);
-	struct is_banned_info *info = (struct is_banned_info*)extra;
-	if (ban_type(ban) == info->type &&
-	    ban_target(ban) == info->target &&
-	    ((ban_duration(ban) < 0) || (now <= ban_timestamp(ban) + ban_duration(ban))) &&
-	    (!info->board || ban_matches_board(ban, board_id(info->board)))) {
-		if (ban_duration(ban) > 0) {
-			int64 expires = ban_timestamp(ban) + ban_duration(ban);
-			if (expires > info->expires)
-				info->expires = expires;
-		} else {
-			info->expires = -1;
-		}
+	if (*until < 0)
+		return;
+	if (ban_duration(ban) > 0) {
+		int64 expires = ban_timestamp(ban) + ban_duration(ban);
+		if (expires > *until)
+			*until = expires;
+	} else {
+		*until = -1;
 	}
 }
 
-int64 is_banned(struct ip *ip, struct board *board, enum ban_target target)
+static void evaluate_bans_callback(struct ban *ban, struct ip *ip, void *extra)
 {
-	struct is_banned_info info = {0};
-	info.type = BAN_BLACKLIST;
-	info.target = target;
-	info.board = board;
-	find_bans(ip, is_banned_callback, &info);
-	return info.expires;
-}
+	struct evaluate_bans_info *info = (struct evaluate_bans_info*)extra;
+	struct ban_verdict *verdict = info->verdict;
+	if (ban_target(ban) != info->target ||
+	    ((ban_duration(ban) >= 0) && (info->now > ban_timestamp(ban) + ban_duration(ban))) ||
+	    (info->board && !ban_matches_board(ban, board_id(info->board))))
+		return;
+
+	switch (ban_type(ban)) {
+		case BAN_BLACKLIST:         extend_until(&verdict->banned,  ban); break;
+		case BAN_FLOOD:             extend_until(&verdict->flood,   ban); break;
+		case BAN_CAPTCHA_ONCE:
+		case BAN_CAPTCHA_PERMANENT: extend_until(&verdict->captcha, ban); break;
+	}
 
-int64 is_flood_limited(struct ip *ip, struct board *board, enum ban_target target)
-{
-	struct is_banned_info info = {0};
-	info.type = BAN_FLOOD;
-	info.target = target;
-	info.board = board;
-	find_bans(ip, is_banned_callback, &info);
-	return info.expires;
+	if (verdict->callback)
+		verdict->callback(ban, ip, verdict->extra);
 }
 
-int64 is_captcha_required(struct ip *ip, struct board *board, enum ban_target target)
+void evaluate_bans(struct ban_verdict *verdict, struct ip *ip, struct ip *x_real_ip, array *x_forwarded_for,
+                   struct board *board, enum ban_target target)
 {
-	struct is_banned_info info = {0};
-	info.type = BAN_CAPTCHA_PERMANENT;
-	info.target = target;
+	struct evaluate_bans_info info = {0};
+	info.now = time(NULL);
 	info.board = board;
-	find_bans(ip, is_banned_callback, &info);
-	if (!info.expires) {
-		info.type = BAN_CAPTCHA_ONCE;
-		info.target = target;
-		info.board = board;
-		find_bans(ip, is_banned_callback, &info);
+	info.target = target;
+	info.verdict = verdict;
+
+	verdict->now = info.now;
+	verdict->banned = 0;
+	verdict->flood = 0;
+	verdict->captcha = 0;
+
+	find_bans(ip, evaluate_bans_callback, &info);
+	// Proxies often repeat the address of the client, don't walk the same address twice
+	if (x_real_ip->version && !ip_eq(x_real_ip, ip))
+		find_bans(x_real_ip, evaluate_bans_callback, &info);
+
+	size_t count = array_length(x_forwarded_for, sizeof(struct ip));
+	for (size_t i=0; i<count; ++i) {
+		struct ip *x = array_get(x_forwarded_for, sizeof(struct ip), i);
+		if (ip_eq(x, ip) || (x_real_ip->version && ip_eq(x, x_real_ip)))
+			continue;
+		size_t j;
+		for (j=0; j<i; ++j) {
+			if (ip_eq(x, array_get(x_forwarded_for, sizeof(struct ip), j)))
+				break;
+		}
+		if (j == i)
+			find_bans(x, evaluate_bans_callback, &info);
 	}
-	return info.expires;
 }
 
-int64 any_ip_affected(struct ip *ip, struct ip *x_real_ip, array *x_forwarded_for,
-                      struct board *board, enum ban_target target,
-                      int64 (*predicate)(struct ip *ip, struct board *board, enum ban_target target))
+int64 next_ban_expiry()
 {
-	int64 affected = 0;
-	affected = predicate(ip, board, BAN_TARGET_POST);
-	if (!affected)
-		affected = predicate(x_real_ip, board, BAN_TARGET_POST);
-	if (!affected) {
-		size_t count = array_length(x_forwarded_for, sizeof(struct ip));
-		for (size_t i=0; i<count; ++i) {
-			struct ip *x = array_get(x_forwarded_for, sizeof(struct ip), i);
-			if (affected = predicate(x, board, BAN_TARGET_POST))
-				break;
-		}
-	}
-	return affected;
+	db_btree_iter it;
+	if (!db_btree_first(&ban_expiry_idx, &it))
+		return -1;
+	return it.key;
 }
 
-void purge_expired_bans()
+size_t purge_expired_bans(size_t max)
 {
 	uint64 now = time(NULL);
-	struct ban *ban = master_first_ban(master);
-	while (ban) {
-		struct ban *next = ban_next_ban(ban);
-		if (ban_duration(ban) >= 0 && now > ban_timestamp(ban) + ban_duration(ban)) {
-			delete_ban(ban);
-		}
-		ban = next;
+	size_t count = 0;
+	db_btree_iter it;
+	while (count < max && db_btree_first(&ban_expiry_idx, &it) && it.key < now) {
+		delete_ban(it.val);
+		++count;
 	}
+	return count;
 }
@@ -10,14 +10,26 @@ int ban_matches_board(struct ban *ban, uint64 board_id);
 typedef void (*find_bans_callback)(struct ban *ban, struct ip *ip, void *extra);
 void find_bans(struct ip *ip, find_bans_callback callback, void *extra);
 
-int64 is_banned(struct ip *ip, struct board *board, enum ban_target target);
-int64 is_flood_limited(struct ip *ip, struct board *board, enum ban_target target);
-int64 is_captcha_required(struct ip *ip, struct board *board, enum ban_target target);
+// Outcome of all bans that apply to a request. The times are 0 if no such ban applies, -1 if one of
+// them never expires, otherwise the latest expiry.
+struct ban_verdict {
+	uint64 now;    // Time at which the bans were evaluated
+	int64 banned;  // Blacklisted
+	int64 flood;   // Flood limited
+	int64 captcha; // Captcha required, once or permanently
 
-int64 any_ip_affected(struct ip *ip, struct ip *x_real_ip, array *x_forwarded_for,
-                      struct board *board, enum ban_target target,
-                      int64 (*predicate)(struct ip *ip, struct board *board, enum ban_target target));
+	// Optional, called for every ban that applies
+	find_bans_callback callback;
+	void *extra;
+};
 
-void purge_expired_bans();
+// Walks the bans of the client address and of each address reported by proxies once
+void evaluate_bans(struct ban_verdict *verdict, struct ip *ip, struct ip *x_real_ip, array *x_forwarded_for,
+                   struct board *board, enum ban_target target);
+
+// Time at which the next ban with a duration expires, -1 if there is none
+int64 next_ban_expiry();
+// Deletes at most max expired bans, returns their number
+size_t purge_expired_bans(size_t max);
 
 #endif // BANS_H
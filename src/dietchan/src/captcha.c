@@ -37,7 +37,7 @@ void replace_captcha(struct captcha *captcha)
 	begin_transaction();
 
 	// Answer is valid -> remove captcha and replace with new one
-	db_hashmap_remove(&captcha_tbl, &captcha_id(captcha));
+	db_u64map_remove(&captcha_tbl, captcha_id(captcha));
 
 	uint64 idx = captcha_idx(captcha);
 	uint64 count = master_captcha_count(master);
@@ -112,7 +112,7 @@ static void captcha_job_finish(job_context *job, int status)
 		master_set_captcha_count(master, count);
 
 		uint64 *captchas = master_captchas(master);
-		captchas = db_realloc(db, captchas, sizeof(uint64)*count);
+		captchas = db_realloc_array(db, captchas, sizeof(uint64)*count);
 		master_set_captchas(master, captchas);
 
 		uint64 idx = count-1;
@@ -125,7 +125,7 @@ static void captcha_job_finish(job_context *job, int status)
 		uint64 now = time(0);
 		captcha_set_timestamp(captcha, now);
 
-		db_hashmap_insert(&captcha_tbl, &captcha_id(captcha), captcha);
+		db_u64map_insert(&captcha_tbl, captcha_id(captcha), captcha);
 
 		invalidate_captcha(captcha);
 
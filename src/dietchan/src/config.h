@@ -12,6 +12,55 @@
 #define PREFIX                           ""
 // The path where uploads and static content are stored. Not visible to the public (although the content is).
 #define DOC_ROOT                    "./www"
+// Number of worker processes that render pages which do not modify the database, in addition to
+// the process that handles everything else. 0 disables them. Can be overridden with -w.
+#define WORKER_PROCESSES                  0
+
+// -- Database --
+
+// Transactions committed during the same iteration of the main loop share a single journal
+// flush. Responses are held back until the flush is complete.
+#define DB_GROUP_COMMIT                   1
+// Interval in which a flush that has failed is tried again (milliseconds). The responses of its
+// transactions are held back until it succeeds.
+#define DB_FLUSH_RETRY_INTERVAL         1000
+
+// Write-ahead log mode. Commits only append to the journal, the changes are copied into the
+// database file by a checkpoint when the server is idle or when the journal gets too large.
+#define DB_WAL                            0
+// Size of the journal that triggers a checkpoint
+#define DB_WAL_CHECKPOINT_SIZE    (16*MEGA)
+// Idle time after which a checkpoint is done (milliseconds)
+#define DB_WAL_CHECKPOINT_IDLE         1000
+
+// Find changed data by write-protecting the database and catching the first write to every page,
+// instead of trusting the regions passed to db_invalidate_region(). Only the bytes that actually
+// changed are written to the journal. Linux only.
+#define DB_WRITE_TRACKING                 0
+
+// Write directly to a single shared mapping of the database file and keep the before-images of
+// the modified pages in the journal, instead of keeping modified pages in a private mapping. Hot
+// pages are only cached once, but the first write to every page in a transaction has to wait for
+// the disk. Implies write tracking and cannot be combined with DB_WAL, archiving or worker
+// processes. Linux only.
+#define DB_UNDO_LOG                       0
+
+// Read the first pages of every board at startup and ask the kernel to read the rest of the
+// database ahead and to use huge pages for it.
+#define DB_WARM_UP                        1
+// Number of pages of every board that are read at startup
+#define DB_WARM_UP_PAGES                  1
+
+// Online snapshots of the database are written to this file. A snapshot is started with SIGUSR2 or
+// from the dashboard.
+#define DB_SNAPSHOT_FILE    "dietchan_db.snapshot"
+
+// Interval in which a replica looks for new transactions of the primary (milliseconds)
+#define DB_REPLICA_POLL_INTERVAL        100
+
+// Interval in which the time of the last request of the sessions is written to the database
+// (seconds). Sessions expire at the right time, but after a crash they can live this much longer.
+#define SESSION_FLUSH_INTERVAL           60
 
 // -- Flood limits --
 
@@ -19,10 +68,14 @@
 #define FLOOD_LIMIT                      10
 // Number of seconds to wait between creating two reports (seconds)
 #define REPORT_FLOOD_LIMIT               10
+// Number of clients whose flood limits are tracked at the same time (power of two)
+#define FLOOD_TABLE_SIZE              4096
 
 // -- Bans --
 
 #define DEFAULT_BAN_MESSAGE "BENUTZER WURDE FÜR DIESEN BEITRAG GEBANNT"
+// Maximum number of expired bans that are removed in one transaction while the server is idle
+#define BAN_PURGE_BATCH                 64
 
 // -- Boards --
 
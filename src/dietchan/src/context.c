@@ -53,6 +53,25 @@ static struct chunk* get_chunk()
 
 // -------------------------------------------------------------------------------------------------
 
+// While output is held, flushed contexts are put on this list instead of being sent.
+// This is used to delay responses until the database changes they depend on are on disk.
+static int output_held = 0;
+static context *first_held = 0;
+
+// Returns the buffers of the context to the cache
+static void release_chunks(context *ctx)
+{
+	if (likely(ctx->chunk)) {
+		struct chunk *a = ctx->chunk;
+		struct chunk *b = ctx->chunk->prev;
+		b->next = &chunk_sentinel;
+		a->prev = chunk_sentinel.prev;
+		b->next->prev = b;
+		a->prev->next = a;
+	}
+	ctx->chunk = 0;
+}
+
 void context_init(context *ctx, int fd)
 {
 	byte_zero(ctx, sizeof(context));
@@ -73,14 +92,7 @@ void context_unref(context *ctx)
 		if (ctx->finalize)
 			ctx->finalize(ctx);
 
-		if (likely(ctx->chunk)) {
-			struct chunk *a = ctx->chunk;
-			struct chunk *b = ctx->chunk->prev;
-			b->next = &chunk_sentinel;
-			a->prev = chunk_sentinel.prev;
-			b->next->prev = b;
-			a->prev->next = a;
-		}
+		release_chunks(ctx);
 
 		iob_free(ctx->batch);
 		io_close(ctx->fd);
@@ -105,6 +117,17 @@ int  context_read(context *ctx, char *buf, int length)
 
 void context_flush(context *ctx)
 {
+	if (unlikely(output_held)) {
+		if (!ctx->held) {
+			ctx->held = 1;
+			ctx->next_held = first_held;
+			first_held = ctx;
+			// Keep the context alive until the output is released
+			context_addref(ctx);
+		}
+		return;
+	}
+
 	if (likely(ctx->chunk)) {
 		iob_addbuf(ctx->batch, (char*) ctx->chunk + sizeof(struct chunk), ctx->buf_offset);
 		ctx->buf_size = 0;
@@ -190,6 +213,50 @@ void context_eof(context *ctx)
 }
 
 
+void context_hold_output()
+{
+	output_held = 1;
+}
+
+void context_release_output()
+{
+	output_held = 0;
+
+	while (first_held) {
+		context *ctx = first_held;
+		first_held = ctx->next_held;
+		ctx->next_held = 0;
+		ctx->held = 0;
+
+		context_flush(ctx);
+		context_unref(ctx);
+	}
+}
+
+// Throws away everything that was written to the context but not sent yet, so the response can
+// be started over. Only works as long as nothing has been sent, i.e. while the output is held.
+void context_discard_output(context *ctx)
+{
+	if (ctx->held) {
+		context **prev = &first_held;
+		while (*prev != ctx)
+			prev = &(*prev)->next_held;
+		*prev = ctx->next_held;
+		ctx->next_held = 0;
+		ctx->held = 0;
+		context_unref(ctx);
+	}
+
+	release_chunks(ctx);
+	ctx->buf_size = 0;
+	ctx->buf_offset = 0;
+
+	iob_free(ctx->batch);
+	ctx->batch = iob_new(10);
+	ctx->error = 0;
+	ctx->eof = 0;
+}
+
 size_t context_get_buffer(context *ctx, void **buf)
 {
 	if (unlikely(ctx->buf_offset == ctx->buf_size)) {
@@ -17,6 +17,8 @@ typedef struct context {
 	io_batch *batch;
 	int  error;
 	int  eof;
+	int  held;
+	struct context *next_held;
 	int  (*read)(struct context *ctx, char *buf, int length);
 	void (*finalize)(struct context *ctx);
 	void (*free)(struct context *ctx);
@@ -29,6 +31,10 @@ int  context_read(context *ctx, char *buf, int length);
 void context_flush(context *ctx);
 void context_eof(context *ctx);
 
+void context_hold_output();
+void context_release_output();
+void context_discard_output(context *ctx);
+
 size_t context_get_buffer(context *ctx, void **buf);
 void context_consume_buffer(context *ctx, size_t bytes_written);
 void context_write_data(context *ctx, const void *buf, size_t length);
@@ -0,0 +1,113 @@
+#include "crc32c.h"
+
+#include <libowfat/uint64.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78
+
+static uint32 crc32c_table[8][256];
+static int    crc32c_initialized;
+static int    crc32c_hardware;
+
+static void crc32c_init()
+{
+	for (uint32 i=0; i<256; ++i) {
+		uint32 crc = i;
+		for (int j=0; j<8; ++j)
+			crc = (crc >> 1) ^ ((crc & 1)?CRC32C_POLY:0);
+		crc32c_table[0][i] = crc;
+	}
+	for (uint32 i=0; i<256; ++i) {
+		for (int k=1; k<8; ++k)
+			crc32c_table[k][i] = (crc32c_table[k-1][i] >> 8) ^ crc32c_table[0][crc32c_table[k-1][i] & 0xff];
+	}
+
+	#if defined(__x86_64__)
+	unsigned int eax, ebx, ecx, edx;
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		crc32c_hardware = (ecx & bit_SSE4_2) != 0;
+	#endif
+
+	crc32c_initialized = 1;
+}
+
+// Slicing-by-8, processes 8 bytes per step
+static uint32 crc32c_software(uint32 crc, const unsigned char *p, size_t length)
+{
+	while (length > 0 && ((uintptr_t)p & 7)) {
+		crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+		--length;
+	}
+	while (length >= 8) {
+		uint64 word;
+		memcpy(&word, p, 8);
+		word ^= crc;
+		crc = crc32c_table[7][ word        & 0xff] ^
+		      crc32c_table[6][(word >>  8) & 0xff] ^
+		      crc32c_table[5][(word >> 16) & 0xff] ^
+		      crc32c_table[4][(word >> 24) & 0xff] ^
+		      crc32c_table[3][(word >> 32) & 0xff] ^
+		      crc32c_table[2][(word >> 40) & 0xff] ^
+		      crc32c_table[1][(word >> 48) & 0xff] ^
+		      crc32c_table[0][(word >> 56)       ];
+		p += 8;
+		length -= 8;
+	}
+	while (length > 0) {
+		crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+		--length;
+	}
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32 crc32c_sse42(uint32 crc, const unsigned char *p, size_t length)
+{
+	uint64 crc64;
+	while (length > 0 && ((uintptr_t)p & 7)) {
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+		--length;
+	}
+	crc64 = crc;
+	while (length >= 8) {
+		uint64 word;
+		memcpy(&word, p, 8);
+		crc64 = __builtin_ia32_crc32di(crc64, word);
+		p += 8;
+		length -= 8;
+	}
+	crc = crc64;
+	while (length > 0) {
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+		--length;
+	}
+	return crc;
+}
+#endif
+
+uint32 crc32c(uint32 crc, const void *buf, size_t length)
+{
+	if (!crc32c_initialized)
+		crc32c_init();
+
+	crc = ~crc;
+	#if defined(__x86_64__)
+	if (crc32c_hardware)
+		return ~crc32c_sse42(crc, buf, length);
+	#endif
+	// The table lookup above assumes little endian byte order
+	#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	return ~crc32c_software(crc, buf, length);
+	#else
+	const unsigned char *p = buf;
+	while (length-- > 0)
+		crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+	return ~crc;
+	#endif
+}
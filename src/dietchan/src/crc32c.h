@@ -0,0 +1,11 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <libowfat/uint32.h>
+
+// CRC-32C (Castagnoli). Start with crc=0 and pass the previous result to continue a checksum
+// over several buffers.
+uint32 crc32c(uint32 crc, const void *buf, size_t length);
+
+#endif // CRC32C_H
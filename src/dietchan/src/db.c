@@ -1,6 +1,7 @@
 #define _GNU_SOURCE
 #include "db.h"
 #include "util.h"
+#include "crc32c.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,46 +13,54 @@
 #include <libowfat/io.h>
 #include <assert.h>
 #include <unistd.h>
+#include <limits.h>
+#include <time.h>
 #include <sys/mman.h>
 #include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <dirent.h>
+#include <linux/fs.h>
+#include <signal.h>
+#include <sched.h>
 
 typedef uint32 journal_entry_type;
 
-typedef enum db_region_boundary_type {
-	DB_REGION_START,
-	DB_REGION_END
-} db_region_boundary_type;
+// Every transaction is written as one frame. A frame is only replayed if it is complete, its
+// checksum matches and its sequence number follows the one of the previous frame.
+typedef struct __attribute__((packed)) journal_frame_header {
+	uint32 magic;
+	uint32 checksum; // CRC32C over sequence, length and all records of the frame
+	uint64 sequence;
+	uint64 length;   // Size of the records following the header
+} journal_frame_header;
 
-typedef struct db_region_boundary {
-	db_region_boundary_type type:1;
-	db_ptr position:63;
-} db_region_boundary;
-
-static int region_boundary_comp(const void *_a, const void *_b)
-{
-	const db_region_boundary *a = _a;
-	const db_region_boundary *b = _b;
-	if (a->position < b->position)
-		return -1;
-	if (a->position > b->position)
-		return +1;
-
-	if (a->type == DB_REGION_START && b->type == DB_REGION_END)
-		return -1;
-
-	if (a->type == DB_REGION_END   && b->type == DB_REGION_START)
-		return -1;
-
-	return 0;
-}
+typedef struct __attribute__((packed)) journal_write_header {
+	journal_entry_type type;
+	db_ptr             ptr;
+	uint64             size;
+} journal_write_header;
 
+#define JOURNAL_MAGIC  0x4c4e524a /* "JRNL" */
+#define UNDO_MAGIC     0x4f444e55 /* "UNDO" */
 #define JOURNAL_WRITE  0
-#define JOURNAL_COMMIT 1
 
-static int db_check_journal(db_obj *db);
-static void db_replay_journal(db_obj *db);
+static int64 db_replay_journal(db_obj *db, int64 length, int verify);
+static void db_rollback_journal(db_obj *db, int64 length);
+static int  enable_write_faults(db_obj *db);
+static int  write_iov(int fd, struct iovec *iov, size_t count);
+static void snapshot_track(db_obj *db, int64 start, uint64 size);
+static void archive_frame(db_obj *db, uint64 sequence, struct iovec *iov, size_t count);
+static int  db_sync_replayed_regions(db_obj *db);
+static int  db_truncate_journal(db_obj *db);
 static void db_init(db_obj *db);
 static void db_grow(db_obj *db);
+static void buddy_free(db_obj *db, void *ptr);
+static uint64 bucket_size(int i);
+static db_obj* db_open_read_only(db_obj *db, const char *file);
+static void begin_write(db_obj *db);
+static void end_write(db_obj *db);
 
 //#define MAP_SIZE 1024UL*1024UL*1024UL // 1 GB... use this for valgrind
 #define MAP_SIZE ((sizeof(long)==8)? \
@@ -59,9 +68,20 @@ static void db_grow(db_obj *db);
                   (256UL*1024UL*1024UL))           /* 256 MB... use this for 32 bit systems */
 
 db_obj* db_open(const char *file)
+{
+	return db_open_mode(file, 0);
+}
+
+db_obj* db_open_mode(const char *file, int flags)
 {
 	db_obj *db = malloc(sizeof(db_obj));
-	byte_zero(db, sizeof(db));
+	byte_zero(db, sizeof(db_obj));
+	db_dirty_init(&db->dirty_regions);
+	db_dirty_init(&db->replayed_regions);
+	db_dirty_init(&db->snapshot.changed);
+	db->snapshot.fd = -1;
+	db->archive_fd = -1;
+	db->follow_fd = -1;
 
 	size_t journal_path_length = strlen(file) + strlen(".journal") +1;
 	char *journal = alloca(journal_path_length);
@@ -69,6 +89,9 @@ db_obj* db_open(const char *file)
 	strcat(journal, file);
 	strcat(journal, ".journal");
 
+	if (flags & DB_OPEN_READ_ONLY)
+		return db_open_read_only(db, file);
+
 	db->fd = open_rw(file);
 	if (db->fd < 0) {
 		perror("Could not open database");
@@ -82,7 +105,7 @@ db_obj* db_open(const char *file)
 	db->journal_fd = open_rw(journal);
 	io_closeonexec(db->journal_fd);
 
-	db->shared_map = mmap(0, MAP_SIZE, PROT_WRITE, MAP_SHARED | MAP_NORESERVE, db->fd, 0);
+	db->shared_map = mmap(0, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, db->fd, 0);
 	if (db->shared_map == 0) {
 		perror("mmap (shared) is NULL");
 		goto fail;
@@ -91,25 +114,57 @@ db_obj* db_open(const char *file)
 		perror("mmap (shared) failed");
 		goto fail;
 	}
-	db->priv_map   = mmap(0, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, db->fd, 0);
-	if (db->priv_map == 0) {
-		perror("mmap is NULL");
-		goto fail;
-	}
-	if (db->priv_map == (char*)-1) {
-		perror("mmap (private) failed");
-		goto fail;
+	if (flags & DB_OPEN_UNDO_LOG) {
+		// Everything is written directly to the shared mapping
+		db->undo_log = 1;
+		db->priv_map = db->shared_map;
+	} else {
+		db->priv_map   = mmap(0, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, db->fd, 0);
+		if (db->priv_map == 0) {
+			perror("mmap is NULL");
+			goto fail;
+		}
+		if (db->priv_map == (char*)-1) {
+			perror("mmap (private) failed");
+			goto fail;
+		}
 	}
 
 	db->header = (db_header*)db->priv_map;
 	db->bucket0 = (char*)db->header + sizeof(db_header) - 1; /* -1 for alignment */
 
-	if (db_check_journal(db) == 1) {
-		db_replay_journal(db);
+	// Recover all complete transactions from the journal and discard anything after the first
+	// incomplete or damaged frame. An undo log instead belongs to a transaction that was not
+	// committed, which is rolled back.
+	int64 journal_length = lseek(db->journal_fd, 0, SEEK_END);
+	if (journal_length > 0) {
+		uint32 magic = 0;
+		pread(db->journal_fd, &magic, sizeof(magic), 0);
+		if (magic == UNDO_MAGIC)
+			db_rollback_journal(db, journal_length);
+		else
+			db_replay_journal(db, journal_length, 1);
+		db_truncate_journal(db);
+	}
+
+	// The undo log needs the before-image of every page, which can only be taken by catching
+	// the first write
+	if (db->undo_log && enable_write_faults(db) != 0)
+		goto fail;
+
+	off_t size = lseek(db->fd, 0, SEEK_END);
+	if (size == 0) {
+		db_init(db);
 	} else {
-		off_t size = lseek(db->fd, 0, SEEK_END);
-		if (size == 0) {
-			db_init(db);
+		db->sequence = db->header->sequence;
+
+		// Older versions did not keep track of the size, so buckets were never merged
+		uint64 expected_size = sizeof(db_header) + (db->header->bucket_count?bucket_size(db->header->bucket_count-1):0);
+		if (db->header->size != expected_size) {
+			db_begin_transaction(db);
+			db->header->size = expected_size;
+			db_invalidate_region(db, &db->header->size, sizeof(uint64));
+			db_commit(db);
 		}
 	}
 
@@ -120,6 +175,41 @@ fail:
 	return 0;
 }
 
+// Maps the file of a database that is owned by another process. No lock is taken and the journal
+// is left alone, the owner takes care of both.
+static db_obj* db_open_read_only(db_obj *db, const char *file)
+{
+	db->read_only = 1;
+	db->journal_fd = -1;
+	db->fd = open_read(file);
+	if (db->fd < 0) {
+		perror("Could not open database");
+		goto fail;
+	}
+	io_closeonexec(db->fd);
+	if (lseek(db->fd, 0, SEEK_END) == 0) {
+		fprintf(stderr, "Could not open database: The file is empty\n");
+		goto fail;
+	}
+
+	db->shared_map = mmap(0, MAP_SIZE, PROT_READ, MAP_SHARED | MAP_NORESERVE, db->fd, 0);
+	if (db->shared_map == MAP_FAILED) {
+		perror("mmap (shared) failed");
+		goto fail;
+	}
+	db->priv_map = db->shared_map;
+	db->header = (db_header*)db->priv_map;
+	db->bucket0 = (char*)db->header + sizeof(db_header) - 1; /* -1 for alignment */
+	db->sequence = db->header->sequence;
+	return db;
+
+fail:
+	if (db->fd >= 0)
+		close(db->fd);
+	free(db);
+	return 0;
+}
+
 static db_bucket* get_bucket(db_obj *db, int index)
 {
 	return (db_bucket*)(db_unmarshal(db, db->header->buckets[index]));
@@ -222,7 +312,7 @@ static db_bucket* get_bucket_at_position(db_obj *db, uint64 pos)
 }
 
 
-void* db_alloc(db_obj *db, const uint64 size)
+static void* buddy_alloc(db_obj *db, const uint64 size)
 {
 	int i = get_bucket_for_size(db, size);
 
@@ -267,18 +357,232 @@ void* db_alloc(db_obj *db, const uint64 size)
 	return ((char*)bucket + sizeof(uchar));
 }
 
+// Grows an allocated bucket to the given order by absorbing its upper buddies.
+// Only possible if the bucket is the lower half at every level up to the new order and all the
+// upper halves are completely free.
+static int grow_bucket(db_obj *db, db_bucket *bucket, int order)
+{
+	if (order >= db->header->bucket_count)
+		return 0;
+
+	uint64 pos = get_position_of_bucket(db, bucket);
+	for (int i=bucket->order; i<order; ++i) {
+		if (pos & (1ULL << i))
+			return 0;
+		db_bucket *buddy = get_bucket_at_position(db, pos + (1ULL << i));
+		if (!buddy || !buddy->free || buddy->order != i)
+			return 0;
+	}
+
+	for (int i=bucket->order; i<order; ++i)
+		extract_bucket(db, get_bucket_at_position(db, pos + (1ULL << i)));
+
+	bucket->order = order;
+	db_invalidate_region(db, bucket, sizeof(uchar));
+	return 1;
+}
+
+// Small objects are allocated from slab pages instead of buddy blocks.
+// A slab page is a buddy block of SLAB_PAGE_SIZE bytes: the db_slab header followed by slots of
+// one size class. Like a buddy block, every slot starts with a tag byte. The tag uses an order
+// that buddy blocks never have, so the allocator can tell both kinds of objects apart by looking
+// at the byte before the object.
+// Allocating or freeing a slot only touches one bitmap word and the counter of its page.
+
+#define SLAB_PAGE_SIZE   4096
+#define SLAB_HEADER_SIZE 64  // Includes the tag byte of the page, keeps the slots aligned
+#define SLAB_TAG_ORDER   64  // Order of the first size class in the slot tags
+#define SLAB_MAX_SIZE    (16*DB_SLAB_CLASS_COUNT - sizeof(uchar))
+
+typedef struct db_slab {
+	uint16 slot_size;
+	uint16 capacity;
+	uint16 used;
+	uint16 size_class;
+	db_ptr next;
+	db_ptr prev;
+	uint64 bitmap[4];
+} db_slab;
+
+static int slab_class_for_size(uint64 size)
+{
+	return (size + sizeof(uchar) + 15)/16 - 1;
+}
+
+static uint64 slab_slot_size(int size_class)
+{
+	return 16*(size_class+1);
+}
+
+static int is_slab_object(const void *ptr)
+{
+	const db_bucket *tag = (const db_bucket*)((const char*)ptr - sizeof(uchar));
+	return tag->order >= SLAB_TAG_ORDER;
+}
+
+static db_slab* get_slab_of_object(db_obj *db, const void *ptr)
+{
+	uint64 offset = ((const char*)ptr - db->bucket0) & ~(uint64)(SLAB_PAGE_SIZE-1);
+	return (db_slab*)(db->bucket0 + offset + sizeof(uchar));
+}
+
+static char* get_slab_slot(db_slab *slab, uint64 index)
+{
+	return (char*)slab - sizeof(uchar) + SLAB_HEADER_SIZE + index*slab->slot_size;
+}
+
+// Usable size of an allocated object
+static uint64 object_size(const void *ptr)
+{
+	const db_bucket *tag = (const db_bucket*)((const char*)ptr - sizeof(uchar));
+	if (tag->order >= SLAB_TAG_ORDER)
+		return slab_slot_size(tag->order - SLAB_TAG_ORDER) - sizeof(uchar);
+	return net_bucket_size(tag->order);
+}
+
+static db_ptr* get_slab_lists(db_obj *db)
+{
+	if (!db->header->slabs) {
+		db_ptr *lists = buddy_alloc(db, sizeof(db_ptr)*DB_SLAB_CLASS_COUNT);
+		byte_zero(lists, sizeof(db_ptr)*DB_SLAB_CLASS_COUNT);
+		db_invalidate_region(db, lists, sizeof(db_ptr)*DB_SLAB_CLASS_COUNT);
+		db->header->slabs = db_marshal(db, lists);
+		db_invalidate_region(db, &db->header->slabs, sizeof(db_ptr));
+	}
+	return db_unmarshal(db, db->header->slabs);
+}
+
+static void slab_list_insert(db_obj *db, db_ptr *lists, db_slab *slab)
+{
+	db_slab *next = db_unmarshal(db, lists[slab->size_class]);
+	slab->next = db_marshal(db, next);
+	slab->prev = 0;
+	if (next) {
+		next->prev = db_marshal(db, slab);
+		db_invalidate_region(db, &next->prev, sizeof(db_ptr));
+	}
+	lists[slab->size_class] = db_marshal(db, slab);
+	db_invalidate_region(db, &slab->next, 2*sizeof(db_ptr));
+	db_invalidate_region(db, &lists[slab->size_class], sizeof(db_ptr));
+}
+
+static void slab_list_remove(db_obj *db, db_ptr *lists, db_slab *slab)
+{
+	db_slab *prev = db_unmarshal(db, slab->prev);
+	db_slab *next = db_unmarshal(db, slab->next);
+	if (prev) {
+		prev->next = slab->next;
+		db_invalidate_region(db, &prev->next, sizeof(db_ptr));
+	} else {
+		lists[slab->size_class] = slab->next;
+		db_invalidate_region(db, &lists[slab->size_class], sizeof(db_ptr));
+	}
+	if (next) {
+		next->prev = slab->prev;
+		db_invalidate_region(db, &next->prev, sizeof(db_ptr));
+	}
+	slab->next = 0;
+	slab->prev = 0;
+	db_invalidate_region(db, &slab->next, 2*sizeof(db_ptr));
+}
+
+static db_slab* new_slab(db_obj *db, int size_class)
+{
+	db_slab *slab = buddy_alloc(db, SLAB_PAGE_SIZE - sizeof(uchar));
+	byte_zero(slab, sizeof(db_slab));
+	slab->slot_size  = slab_slot_size(size_class);
+	slab->capacity   = (SLAB_PAGE_SIZE - SLAB_HEADER_SIZE)/slab->slot_size;
+	slab->size_class = size_class;
+
+	for (uint64 i=0; i<slab->capacity; ++i) {
+		db_bucket *tag = (db_bucket*)get_slab_slot(slab, i);
+		tag->order = SLAB_TAG_ORDER + size_class;
+		tag->free  = 0;
+	}
+
+	db_invalidate_region(db, slab, SLAB_PAGE_SIZE - sizeof(uchar));
+	return slab;
+}
+
+static void* slab_alloc(db_obj *db, int size_class)
+{
+	db_ptr *lists = get_slab_lists(db);
+	db_slab *slab = db_unmarshal(db, lists[size_class]);
+	if (!slab) {
+		slab = new_slab(db, size_class);
+		slab_list_insert(db, lists, slab);
+	}
+
+	uint64 index = 0;
+	for (int w=0; ; ++w) {
+		assert(w < sizeof(slab->bitmap)/sizeof(uint64));
+		if (~slab->bitmap[w]) {
+			index = w*64 + __builtin_ctzll(~slab->bitmap[w]);
+			slab->bitmap[w] |= 1ULL << (index%64);
+			db_invalidate_region(db, &slab->bitmap[w], sizeof(uint64));
+			break;
+		}
+	}
+	assert(index < slab->capacity);
+
+	++slab->used;
+	db_invalidate_region(db, &slab->used, sizeof(uint16));
+
+	// Full slabs are not kept in the list
+	if (slab->used == slab->capacity)
+		slab_list_remove(db, lists, slab);
+
+	return get_slab_slot(slab, index) + sizeof(uchar);
+}
+
+static void slab_free(db_obj *db, void *ptr)
+{
+	db_slab *slab = get_slab_of_object(db, ptr);
+	uint64 index = ((char*)ptr - sizeof(uchar) - get_slab_slot(slab, 0))/slab->slot_size;
+	uint64 *word = &slab->bitmap[index/64];
+
+	assert(*word & (1ULL << (index%64)));
+	*word &= ~(1ULL << (index%64));
+	db_invalidate_region(db, word, sizeof(uint64));
+
+	--slab->used;
+	db_invalidate_region(db, &slab->used, sizeof(uint16));
+
+	db_ptr *lists = get_slab_lists(db);
+	if (slab->used == slab->capacity-1) {
+		slab_list_insert(db, lists, slab);
+	} else if (slab->used == 0 && (lists[slab->size_class] != db_marshal(db, slab) || slab->next)) {
+		// Return empty pages, but keep the last one of each size class around
+		slab_list_remove(db, lists, slab);
+		buddy_free(db, slab);
+	}
+}
+
+void* db_alloc(db_obj *db, const uint64 size)
+{
+	void *ptr = (size <= SLAB_MAX_SIZE)?slab_alloc(db, slab_class_for_size(size)):buddy_alloc(db, size);
+	db->stats.bytes_requested += size;
+	db->stats.bytes_allocated += object_size(ptr);
+	return ptr;
+}
+
 void* db_realloc(db_obj *db, void *ptr, uint64 new_size)
 {
 	if (!ptr)
 		return db_alloc(db, new_size);
 
-	db_bucket *bucket = (db_bucket*)((char*)ptr - sizeof(uchar));
-	uint64 bucket_size = net_bucket_size(bucket->order);
+	uint64 bucket_size = object_size(ptr);
 	if (bucket_size >= new_size)
 		return ptr;
 
-	// Todo: We could optimize here by merging if buddy is free.
-	// Right now we just always allocate a new buffer and copy the data.
+	if (!is_slab_object(ptr) && new_size > SLAB_MAX_SIZE) {
+		db_bucket *bucket = (db_bucket*)((char*)ptr - sizeof(uchar));
+		if (grow_bucket(db, bucket, get_bucket_for_size(db, new_size))) {
+			db->stats.bytes_requested += new_size;
+			db->stats.bytes_allocated += object_size(ptr);
+			return ptr;
+		}
+	}
 
 	void *new_ptr = db_alloc(db, new_size);
 	memcpy(new_ptr, ptr, bucket_size);
@@ -289,6 +593,20 @@ void* db_realloc(db_obj *db, void *ptr, uint64 new_size)
 	return new_ptr;
 }
 
+// Like db_realloc, but grows the capacity at least by a factor of two. For arrays that are
+// appended to one element at a time.
+void* db_realloc_array(db_obj *db, void *ptr, uint64 new_size)
+{
+	if (ptr) {
+		uint64 capacity = object_size(ptr);
+		if (capacity >= new_size)
+			return ptr;
+		if (new_size < 2*capacity)
+			new_size = 2*capacity;
+	}
+	return db_realloc(db, ptr, new_size);
+}
+
 db_ptr db_marshal(db_obj *db, const void *ptr)
 {
 	return ptr?((db_ptr)ptr - (db_ptr)db->priv_map):0;
@@ -303,7 +621,7 @@ static void merge_buckets(db_obj *db, db_bucket *bucket)
 {
 	while(1) {
 		uint64 pos       = get_position_of_bucket(db, bucket);
-		uint64 buddy_pos = pos ^ (1 << bucket->order);
+		uint64 buddy_pos = pos ^ (1ULL << bucket->order);
 
 		db_bucket *buddy = get_bucket_at_position(db, buddy_pos);
 		if (!buddy)
@@ -332,11 +650,8 @@ static void merge_buckets(db_obj *db, db_bucket *bucket)
 	}
 }
 
-void db_free(db_obj *db, void *ptr)
+static void buddy_free(db_obj *db, void *ptr)
 {
-	if (!ptr)
-		return;
-
 	db_bucket *bucket = (db_bucket*)((char*)ptr - sizeof(uchar));
 
 	#if 0
@@ -351,6 +666,17 @@ void db_free(db_obj *db, void *ptr)
 	merge_buckets(db, bucket);
 }
 
+void db_free(db_obj *db, void *ptr)
+{
+	if (!ptr)
+		return;
+
+	if (is_slab_object(ptr))
+		slab_free(db, ptr);
+	else
+		buddy_free(db, ptr);
+}
+
 void* db_get_master_ptr(db_obj *db)
 {
 	return db_unmarshal(db, db->header->master_pointer);
@@ -364,13 +690,14 @@ void db_set_master_ptr(db_obj *db, void *ptr)
 
 void db_begin_transaction(db_obj *db)
 {
+	// The mapping is not writable
+	assert(!db->read_only);
 	++db->transactions;
 }
 
 void db_invalidate(db_obj *db, void *ptr)
 {
-	db_bucket *bucket = (db_bucket*)((char*)ptr - sizeof(uchar));
-	db_invalidate_region(db, ptr, net_bucket_size(bucket->order));
+	db_invalidate_region(db, ptr, object_size(ptr));
 }
 
 void db_invalidate_region(db_obj *db, void *ptr, const uint64 size)
@@ -380,157 +707,1062 @@ void db_invalidate_region(db_obj *db, void *ptr, const uint64 size)
 	assert(size > 0);
 
 	db->changed = 1;
+	// With write tracking the changes are found by comparing the written pages at flush time
+	if (db->write_tracking)
+		return;
+	db_dirty_insert(&db->dirty_regions, db_marshal(db, ptr), size);
+}
 
-	size_t len=array_length(&db->dirty_regions, sizeof(db_region_boundary));
-	db_region_boundary *start = array_allocate(&db->dirty_regions, sizeof(db_region_boundary), len);
-	db_region_boundary *end = array_allocate(&db->dirty_regions, sizeof(db_region_boundary), len+1);
+// --- Write tracking ---
+// Instead of relying on db_invalidate_region(), the private mapping is made read-only. The first
+// write to a page raises SIGSEGV, the handler saves a copy of the page, records it in a bitmap and
+// makes it writable again. At flush time, the written pages are compared to their copies and only
+// the bytes that actually differ are written to the journal. Afterwards the pages are made
+// read-only again.
+// The copy is needed because the shared mapping is not up to date in WAL mode: a byte that is
+// changed back to the value in the database file would not be journaled.
+// Note that system calls writing into the database (e.g. read()) fail with EFAULT instead of
+// faulting, so the database must only be written by user space code.
+
+// Differences that are closer than this are written as a single region, because every region
+// costs a record header in the journal.
+#define WRITE_TRACKING_MIN_GAP (sizeof(journal_write_header))
+
+// Only one database per process can be tracked, the signal handler has no other way to find it.
+static db_obj *tracked_db;
+static struct sigaction previous_sigsegv;
+
+// Appends the current contents of the page to the undo log and waits until it is on disk, before
+// the page may be modified. Called from the signal handler, so only async-signal-safe functions
+// may be used.
+static void log_before_image(db_obj *db, uint64 page)
+{
+	// Pages beyond the end of the database hold nothing that has to be restored
+	uint64 start = page*db->page_size;
+	if (start >= db->header->size)
+		return;
+	uint64 size = db->page_size;
+	if (start + size > db->header->size)
+		size = db->header->size - start;
+
+	journal_write_header record;
+	record.type = JOURNAL_WRITE;
+	record.ptr  = start;
+	record.size = size;
+
+	journal_frame_header frame;
+	frame.magic    = UNDO_MAGIC;
+	frame.sequence = db->sequence + 1;
+	frame.length   = sizeof(journal_write_header) + size;
+	uint32 crc = crc32c(0, &frame.sequence, sizeof(frame.sequence) + sizeof(frame.length));
+	crc = crc32c(crc, &record, sizeof(record));
+	frame.checksum = crc32c(crc, db->priv_map + start, size);
+
+	struct iovec iov[3] = {
+		{ &frame, sizeof(frame) },
+		{ &record, sizeof(record) },
+		{ db->priv_map + start, size }
+	};
+
+	if (lseek(db->journal_fd, db->journal_size, SEEK_SET) < 0 ||
+	    write_iov(db->journal_fd, iov, 3) < 0 ||
+	    fdatasync(db->journal_fd) < 0) {
+		// Modifying the page without a durable before-image could corrupt the database
+		static const char message[] = "Could not write undo log, aborting\n";
+		write(2, message, sizeof(message)-1);
+		abort();
+	}
+	db->journal_size += sizeof(frame) + frame.length;
+}
 
-	start->type = DB_REGION_START;
-	start->position = db_marshal(db, ptr);
+static void write_fault_handler(int sig, siginfo_t *info, void *context)
+{
+	db_obj *db = tracked_db;
+	char *addr = info->si_addr;
+	if (db && addr >= db->priv_map && addr < db->priv_map + MAP_SIZE) {
+		uint64 page = (addr - db->priv_map)/db->page_size;
+		if (db->undo_log) {
+			log_before_image(db, page);
+			begin_write(db);
+		} else
+			byte_copy(db->shadow_map + page*db->page_size, db->page_size, db->priv_map + page*db->page_size);
+		if (page < db->written_capacity)
+			db->written_pages[page/64] |= 1ULL << (page%64);
+		else
+			db->written_overflow = 1;
+		db->changed = 1;
+		if (mprotect(db->priv_map + page*db->page_size, db->page_size, PROT_READ | PROT_WRITE) == 0)
+			return;
+	}
 
-	end->type = DB_REGION_END;
-	end->position = start->position + size;
+	// Not ours, let the previous handler deal with it
+	if (previous_sigsegv.sa_flags & SA_SIGINFO) {
+		previous_sigsegv.sa_sigaction(sig, info, context);
+	} else if (previous_sigsegv.sa_handler != SIG_IGN && previous_sigsegv.sa_handler != SIG_DFL) {
+		previous_sigsegv.sa_handler(sig);
+	} else {
+		// Returning re-executes the faulting instruction, which then crashes as usual
+		signal(SIGSEGV, SIG_DFL);
+	}
 }
 
-static void db_init(db_obj *db)
+// Makes sure the bitmap of written pages covers a file of the given size. Must be called before
+// the file is extended.
+static void reserve_written_pages(db_obj *db, uint64 file_size)
 {
-	uint64 size = sizeof(db_header);
-	fallocate(db->fd, 0, 0, size);
+	if (!db->write_tracking)
+		return;
+	uint64 pages = (file_size + db->page_size - 1)/db->page_size;
+	if (pages <= db->written_capacity)
+		return;
 
-	db_begin_transaction(db);
+	uint64 capacity = db->written_capacity?db->written_capacity:64;
+	while (capacity < pages)
+		capacity *= 2;
+	uint64 *bitmap = malloc(capacity/8);
+	byte_zero(bitmap, capacity/8);
+	if (db->written_pages)
+		byte_copy(bitmap, db->written_capacity/8, db->written_pages);
+
+	// The handler may run at any write to the database, so the new bitmap must be complete
+	// before it is published.
+	uint64 *old = db->written_pages;
+	db->written_pages = bitmap;
+	db->written_capacity = capacity;
+	free(old);
+}
 
-	#if 0
-	// For debugging: Initialize whole file with "random" data
-	{
-		uint64 s = 0x4412457309583741;
-		uint64 r = s;
-		uint64 *p = (uint64*)db->header;
-		for (int64 i=0; i<size/sizeof(uint64); ++i) {
-			*p = r;
-			r = r*s + s;
-			++p;
+// Adds the bytes of the page that differ from the copy taken before the first write to the dirty
+// regions.
+static void diff_page(db_obj *db, uint64 page, uint64 file_size)
+{
+	const char *a = db->priv_map;
+	const char *b = db->shadow_map;
+	uint64 pos = page*db->page_size;
+	uint64 end = pos + db->page_size;
+	if (end > file_size)
+		end = file_size;
+
+	int64 run_start = -1;
+	int64 run_end = -1;
+	while (pos < end) {
+		// Skip identical words quickly
+		if (!(pos & 7) && pos + 8 <= end && *(const uint64*)(a+pos) == *(const uint64*)(b+pos)) {
+			pos += 8;
+			continue;
+		}
+		if (a[pos] != b[pos]) {
+			if (run_start >= 0 && pos - run_end < WRITE_TRACKING_MIN_GAP) {
+				run_end = pos+1;
+			} else {
+				if (run_start >= 0)
+					db_dirty_insert(&db->dirty_regions, run_start, run_end - run_start);
+				run_start = pos;
+				run_end = pos+1;
+			}
 		}
+		++pos;
 	}
-	db_invalidate_region(db, db->header, size);
-	#endif
+	if (run_start >= 0)
+		db_dirty_insert(&db->dirty_regions, run_start, run_end - run_start);
+}
 
-	byte_zero(db->header, sizeof(db_header));
+// Turns the pages written since the last flush into dirty regions.
+static void collect_written_pages(db_obj *db)
+{
+	uint64 file_size = db->header->size;
+	uint64 pages = (file_size + db->page_size - 1)/db->page_size;
 
-	db->header->size = size;
-	db->header->bucket_count = 0;
-	db_invalidate_region(db, db->header, sizeof(db_header));
+	if (db->written_overflow) {
+		for (uint64 page=0; page<pages; ++page)
+			diff_page(db, page, file_size);
+		return;
+	}
 
-	db_commit(db);
+	uint64 words = (db->written_capacity < pages ? db->written_capacity : pages + 63)/64;
+	for (uint64 w=0; w<words; ++w) {
+		uint64 bits = db->written_pages[w];
+		while (bits) {
+			uint64 page = w*64 + __builtin_ctzll(bits);
+			bits &= bits-1;
+			if (page < pages)
+				diff_page(db, page, file_size);
+		}
+	}
 }
 
-static void db_grow(db_obj *db)
+// Finds the next run of consecutive written pages, starting the search at *page.
+// Returns 0 if there is none.
+static int next_written_run(db_obj *db, uint64 *page, uint64 *count)
 {
-	uint64 order = db->header->bucket_count;
-	if (order == 0) {
-		uint64 s = bucket_size(order-1);
-		fallocate(db->fd, 0, 0, sizeof(db_header) + 2*s);
-		db_bucket *bucket=(db_bucket*)db->bucket0;
-		bucket->order = 0;
-		bucket->free = 1;
-		insert_bucket(db,bucket);
-	} else {
-		uint64 s = bucket_size(order-1);
-		fallocate(db->fd, 0, 0, sizeof(db_header) + 2*s);
-
-		db_bucket *bucket = (db_bucket*)(db->bucket0 + s);
-		bucket->order = order-1;
-		bucket->free = 1;
-		db_invalidate_region(db, bucket, 1);
+	uint64 p = *page;
+	while (p < db->written_capacity) {
+		uint64 bits = db->written_pages[p/64] >> (p%64);
+		if (!bits) {
+			p = (p/64+1)*64;
+			continue;
+		}
+		p += __builtin_ctzll(bits);
+		uint64 n = 1;
+		while (p+n < db->written_capacity && (db->written_pages[(p+n)/64] & (1ULL << ((p+n)%64))))
+			++n;
+		*page  = p;
+		*count = n;
+		return 1;
+	}
+	return 0;
+}
 
-		insert_bucket(db, bucket);
-		merge_buckets(db, bucket);
+// Makes the written pages read-only again, so the next write to them is noticed.
+static void protect_written_pages(db_obj *db)
+{
+	if (db->written_overflow) {
+		mprotect(db->priv_map, MAP_SIZE, PROT_READ);
+		if (db->shadow_map)
+			madvise(db->shadow_map, MAP_SIZE, MADV_DONTNEED);
+		byte_zero(db->written_pages, db->written_capacity/8);
+		db->written_overflow = 0;
+		return;
+	}
 
+	uint64 page = 0;
+	uint64 count;
+	while (next_written_run(db, &page, &count)) {
+		mprotect(db->priv_map + page*db->page_size, count*db->page_size, PROT_READ);
+		// Release the copies
+		if (db->shadow_map)
+			madvise(db->shadow_map + page*db->page_size, count*db->page_size, MADV_DONTNEED);
+		page += count;
 	}
-	++(db->header->bucket_count);
-	db_invalidate_region(db, db->header, sizeof(db_header));
+	byte_zero(db->written_pages, db->written_capacity/8);
 }
 
-// -1: Error
-//  0: Journal empty.
-// +1: Journal contains data that needs to be replayed.
-static int db_check_journal(db_obj *db)
+// Makes the database read-only and installs the handler for the write faults.
+static int enable_write_faults(db_obj *db)
 {
-	journal_entry_type type;
-	db_ptr _ptr;
-	uint64 size;
-	ssize_t consumed;
-
-	int commit = 0;
+	if (tracked_db) {
+		fprintf(stderr, "Write tracking is already enabled for another database\n");
+		return -1;
+	}
+	db->page_size = sysconf(_SC_PAGESIZE);
+	db->write_tracking = 1;
+	// The header cannot be read yet if the file is still empty
+	reserve_written_pages(db, lseek(db->fd, 0, SEEK_END));
+
+	struct sigaction action;
+	byte_zero(&action, sizeof(action));
+	action.sa_sigaction = write_fault_handler;
+	action.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sigemptyset(&action.sa_mask);
+	tracked_db = db;
+	if (sigaction(SIGSEGV, &action, &previous_sigsegv) != 0 ||
+	    mprotect(db->priv_map, MAP_SIZE, PROT_READ) != 0) {
+		perror("Could not enable write tracking");
+		sigaction(SIGSEGV, &previous_sigsegv, 0);
+		tracked_db = 0;
+		db->write_tracking = 0;
+		free(db->written_pages);
+		db->written_pages = 0;
+		db->written_capacity = 0;
+		return -1;
+	}
+	return 0;
+}
 
-	while (1) {
-		consumed = read(db->journal_fd, &type, sizeof(journal_entry_type));
-		if (consumed == 0)
-			break;
-		if (consumed < sizeof(journal_entry_type))
-			goto fail;
+int db_set_write_tracking(db_obj *db, int enabled)
+{
+	if (enabled == db->write_tracking)
+		return 0;
 
-		if (type == JOURNAL_WRITE) {
-			commit = -1;
-			if (read(db->journal_fd, &_ptr, sizeof(db_ptr)) < (ssize_t)sizeof(db_ptr))
-				goto fail;
+	// The undo log depends on write tracking
+	if (db->undo_log)
+		return -1;
 
-			if (read(db->journal_fd, &size, sizeof(uint64)) < (ssize_t)sizeof(uint64))
-				goto fail;
+	// Write out changes that were recorded in the other mode
+	if (db->pending_commits > 0)
+		db_flush(db);
 
-			if (lseek(db->journal_fd, size, SEEK_CUR) < 0)
-				goto fail;
-		} else if (type == JOURNAL_COMMIT) {
-			commit = 1;
+	if (enabled) {
+		db->shadow_map = mmap(0, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (db->shadow_map == MAP_FAILED) {
+			perror("Could not map page copies");
+			db->shadow_map = 0;
+			return -1;
+		}
+		if (enable_write_faults(db) != 0) {
+			munmap(db->shadow_map, MAP_SIZE);
+			db->shadow_map = 0;
+			return -1;
 		}
+	} else {
+		mprotect(db->priv_map, MAP_SIZE, PROT_READ | PROT_WRITE);
+		sigaction(SIGSEGV, &previous_sigsegv, 0);
+		tracked_db = 0;
+		db->write_tracking = 0;
+		free(db->written_pages);
+		munmap(db->shadow_map, MAP_SIZE);
+		db->shadow_map = 0;
+		db->written_pages = 0;
+		db->written_capacity = 0;
+		db->written_overflow = 0;
 	}
+	return 0;
+}
 
-	return commit;
+// --- Compaction ---
+// The caller registers every live object and every field that holds a db_ptr. All objects are
+// then packed at the start of the file: buddy blocks and slab pages sorted by size, so that
+// every block is naturally aligned without gaps. Slab objects are packed into as few pages as
+// possible. Finally the free space at the end is returned to the free lists and the file is
+// truncated to the smallest size that fits.
 
-fail:
-	return -1;
+typedef struct compact_object {
+	db_ptr old;
+	db_ptr new;
+	uint64 size;
+	uint64 buffer_offset;
+	int    size_class; // Slab size class or -1 for buddy blocks
+	int    order;      // Order of the buddy block
+} compact_object;
+
+typedef struct compact_block {
+	int    order;
+	int    size_class; // -1 for buddy blocks
+	size_t index;      // Object for buddy blocks, page number within the size class for slab pages
+	db_ptr old;
+	uint64 position;
+} compact_block;
+
+static int db_ptr_comp(const void *_a, const void *_b)
+{
+	const db_ptr *a = _a;
+	const db_ptr *b = _b;
+	if (*a < *b)
+		return -1;
+	if (*a > *b)
+		return +1;
+	return 0;
 }
 
-static void db_replay_journal(db_obj *db)
+static int compact_block_comp(const void *_a, const void *_b)
 {
-	journal_entry_type type;
-	db_ptr _ptr;
-	uint64 size;
-	ssize_t consumed;
-
-	lseek(db->journal_fd, 0, SEEK_SET);
+	const compact_block *a = _a;
+	const compact_block *b = _b;
+	// Largest blocks first, otherwise keep the previous order
+	if (a->order != b->order)
+		return (a->order > b->order)?-1:+1;
+	if (a->size_class != b->size_class)
+		return (a->size_class < b->size_class)?-1:+1;
+	if (a->old != b->old)
+		return (a->old < b->old)?-1:+1;
+	if (a->index != b->index)
+		return (a->index < b->index)?-1:+1;
+	return 0;
+}
 
-	while (1) {
-		consumed = read(db->journal_fd, &type, sizeof(journal_entry_type));
-		if (consumed == 0)
-			goto success;
-		if (consumed < (ssize_t)sizeof(journal_entry_type))
-			goto fail;
+// Returns the object that contains the position, or 0
+static compact_object* find_compact_object(compact_object *objects, size_t count, db_ptr pos)
+{
+	size_t lo=0, hi=count;
+	while (lo < hi) {
+		size_t mid = lo + (hi-lo)/2;
+		if (objects[mid].old <= pos)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return 0;
+	compact_object *o = &objects[lo-1];
+	if (pos >= o->old + (db_ptr)o->size)
+		return 0;
+	return o;
+}
 
-		if (type == JOURNAL_WRITE) {
-			if (read(db->journal_fd, &_ptr, sizeof(db_ptr)) < (ssize_t)sizeof(db_ptr))
-				goto fail;
+static size_t unique_ptrs(array *a)
+{
+	size_t count = array_length(a, sizeof(db_ptr));
+	db_ptr *p = array_start(a);
+	if (count == 0)
+		return 0;
+	qsort(p, count, sizeof(db_ptr), db_ptr_comp);
+	size_t n=1;
+	for (size_t i=1; i<count; ++i) {
+		if (p[i] != p[n-1])
+			p[n++] = p[i];
+	}
+	array_truncate(a, sizeof(db_ptr), n);
+	return n;
+}
 
-			if (read(db->journal_fd, &size, sizeof(uint64)) < (ssize_t)sizeof(uint64))
-				goto fail;
+void db_compact_begin(db_obj *db, db_compaction *c)
+{
+	byte_zero(c, sizeof(db_compaction));
+	c->db = db;
+}
 
-			char *write_ptr = db->shared_map + _ptr;
+void db_compact_object(db_compaction *c, void *ptr)
+{
+	if (!ptr)
+		return;
+	size_t count = array_length(&c->objects, sizeof(db_ptr));
+	db_ptr *entry = array_allocate(&c->objects, sizeof(db_ptr), count);
+	*entry = db_marshal(c->db, ptr);
+}
 
-			//printf("Replay %p %d\n", _ptr, size);
+void db_compact_pointer(db_compaction *c, db_ptr *field)
+{
+	size_t count = array_length(&c->pointers, sizeof(db_ptr));
+	db_ptr *entry = array_allocate(&c->pointers, sizeof(db_ptr), count);
+	*entry = db_marshal(c->db, field);
+}
 
-			consumed = read(db->journal_fd, write_ptr, size);
-			if (consumed < size)
-				goto fail;
+int db_compact_finish(db_compaction *c)
+{
+	db_obj *db = c->db;
+	int result = -1;
+	compact_object *objects = 0;
+	compact_block *blocks = 0;
+	char *buffer = 0;
+
+	// Cannot move objects while a transaction is in progress
+	assert(db->transactions == 0);
+	db_flush(db);
+
+	size_t object_count  = unique_ptrs(&c->objects);
+	size_t pointer_count = unique_ptrs(&c->pointers);
+	db_ptr *object_ptrs  = array_start(&c->objects);
+	db_ptr *pointers     = array_start(&c->pointers);
+	uint64 space = db->header->bucket_count?bucket_size(db->header->bucket_count-1):0;
+
+	// Check everything before the first change, a mistake in the caller must not destroy the
+	// database
+	objects = malloc(sizeof(compact_object)*(object_count+1));
+	uint64 slab_objects[DB_SLAB_CLASS_COUNT] = {0};
+	uint64 buffer_size = 0;
+	for (size_t i=0; i<object_count; ++i) {
+		compact_object *o = &objects[i];
+		char *ptr = db_unmarshal(db, object_ptrs[i]);
+		db_bucket *tag = (db_bucket*)(ptr - sizeof(uchar));
+		if (ptr - sizeof(uchar) < db->bucket0 || ptr >= db->bucket0 + space || tag->free ||
+		    (tag->order >= BUCKET_COUNT && tag->order < SLAB_TAG_ORDER) ||
+		    tag->order >= SLAB_TAG_ORDER + DB_SLAB_CLASS_COUNT) {
+			fprintf(stderr, "Compaction: %lld is not an allocated object\n", (long long)object_ptrs[i]);
+			goto cleanup;
+		}
+		o->old           = object_ptrs[i];
+		o->size          = object_size(ptr);
+		o->buffer_offset = buffer_size;
+		o->size_class    = is_slab_object(ptr)?(tag->order - SLAB_TAG_ORDER):-1;
+		o->order         = tag->order;
+		if (o->size_class >= 0)
+			++slab_objects[o->size_class];
+		buffer_size += o->size;
+		if (i > 0 && objects[i-1].old + (db_ptr)objects[i-1].size > o->old) {
+			fprintf(stderr, "Compaction: Objects at %lld and %lld overlap\n",
+			        (long long)objects[i-1].old, (long long)o->old);
+			goto cleanup;
 		}
 	}
+	for (size_t i=0; i<pointer_count; ++i) {
+		if (!find_compact_object(objects, object_count, pointers[i]) ||
+		    !find_compact_object(objects, object_count, pointers[i] + sizeof(db_ptr) - 1)) {
+			fprintf(stderr, "Compaction: Pointer at %lld is not inside an object\n", (long long)pointers[i]);
+			goto cleanup;
+		}
+		db_ptr value = *(db_ptr*)db_unmarshal(db, pointers[i]);
+		if (value && !find_compact_object(objects, object_count, value)) {
+			fprintf(stderr, "Compaction: Pointer at %lld points to %lld, which is not inside an object\n",
+			        (long long)pointers[i], (long long)value);
+			goto cleanup;
+		}
+	}
+	db_ptr master_pointer = db->header->master_pointer;
+	if (master_pointer && !find_compact_object(objects, object_count, master_pointer)) {
+		fprintf(stderr, "Compaction: Master object was not registered\n");
+		goto cleanup;
+	}
 
-success:
-	//printf("success!!!!!\n");
-	return;
+	// Layout: one block per buddy object and per slab page
+	const uint64 slab_page_order = get_bucket_for_size(db, SLAB_PAGE_SIZE - sizeof(uchar));
+	uint64 slab_pages[DB_SLAB_CLASS_COUNT];
+	size_t block_count = 0;
+	for (int k=0; k<DB_SLAB_CLASS_COUNT; ++k) {
+		uint64 capacity = (SLAB_PAGE_SIZE - SLAB_HEADER_SIZE)/slab_slot_size(k);
+		slab_pages[k] = (slab_objects[k] + capacity - 1)/capacity;
+		block_count += slab_pages[k];
+	}
+	for (size_t i=0; i<object_count; ++i) {
+		if (objects[i].size_class < 0)
+			++block_count;
+	}
 
-fail:
-	perror("FAIL FAIL FAIL !!!!! Could not replay journal");
+	blocks = malloc(sizeof(compact_block)*(block_count+1));
+	size_t b = 0;
+	for (size_t i=0; i<object_count; ++i) {
+		if (objects[i].size_class >= 0)
+			continue;
+		blocks[b].order      = objects[i].order;
+		blocks[b].size_class = -1;
+		blocks[b].index      = i;
+		blocks[b].old        = objects[i].old;
+		++b;
+	}
+	for (int k=0; k<DB_SLAB_CLASS_COUNT; ++k) {
+		for (uint64 p=0; p<slab_pages[k]; ++p) {
+			blocks[b].order      = slab_page_order;
+			blocks[b].size_class = k;
+			blocks[b].index      = p;
+			blocks[b].old        = 0;
+			++b;
+		}
+	}
+	qsort(blocks, block_count, sizeof(compact_block), compact_block_comp);
+
+	uint64 position = 0;
+	db_ptr *page_positions[DB_SLAB_CLASS_COUNT];
+	for (int k=0; k<DB_SLAB_CLASS_COUNT; ++k)
+		page_positions[k] = malloc(sizeof(db_ptr)*(slab_pages[k]+1));
+	for (size_t i=0; i<block_count; ++i) {
+		blocks[i].position = position;
+		if (blocks[i].size_class < 0)
+			objects[blocks[i].index].new = db_marshal(db, db->bucket0 + position + sizeof(uchar));
+		else
+			page_positions[blocks[i].size_class][blocks[i].index] = position;
+		position += bucket_size(blocks[i].order);
+	}
+	uint64 used_space = position;
+
+	uint64 slot_counter[DB_SLAB_CLASS_COUNT] = {0};
+	for (size_t i=0; i<object_count; ++i) {
+		int k = objects[i].size_class;
+		if (k < 0)
+			continue;
+		uint64 capacity = (SLAB_PAGE_SIZE - SLAB_HEADER_SIZE)/slab_slot_size(k);
+		uint64 page = slot_counter[k]/capacity;
+		uint64 slot = slot_counter[k]%capacity;
+		objects[i].new = db_marshal(db, db->bucket0 + page_positions[k][page] + SLAB_HEADER_SIZE +
+		                                slot*slab_slot_size(k) + sizeof(uchar));
+		++slot_counter[k];
+	}
+
+	uint64 bucket_count = 1;
+	while (bucket_size(bucket_count-1) < used_space)
+		++bucket_count;
+	space = bucket_size(bucket_count-1);
+
+	// Save all objects and update their pointers, because the new positions overlap the old ones
+	buffer = malloc(buffer_size+1);
+	for (size_t i=0; i<object_count; ++i)
+		memcpy(buffer + objects[i].buffer_offset, db_unmarshal(db, objects[i].old), objects[i].size);
+	for (size_t i=0; i<pointer_count; ++i) {
+		compact_object *o = find_compact_object(objects, object_count, pointers[i]);
+		db_ptr *field = (db_ptr*)(buffer + o->buffer_offset + (pointers[i] - o->old));
+		if (*field) {
+			compact_object *target = find_compact_object(objects, object_count, *field);
+			*field = target->new + (*field - target->old);
+		}
+	}
+	if (master_pointer) {
+		compact_object *target = find_compact_object(objects, object_count, master_pointer);
+		master_pointer = target->new + (master_pointer - target->old);
+	}
+
+	// Write the new image
+	db_begin_transaction(db);
+
+	for (size_t i=0; i<block_count; ++i) {
+		db_bucket *tag = (db_bucket*)(db->bucket0 + blocks[i].position);
+		tag->order = blocks[i].order;
+		tag->free  = 0;
+		if (blocks[i].size_class < 0)
+			continue;
+
+		int k = blocks[i].size_class;
+		db_slab *slab = (db_slab*)((char*)tag + sizeof(uchar));
+		byte_zero(slab, SLAB_PAGE_SIZE - sizeof(uchar));
+		slab->slot_size  = slab_slot_size(k);
+		slab->capacity   = (SLAB_PAGE_SIZE - SLAB_HEADER_SIZE)/slab->slot_size;
+		slab->size_class = k;
+		uint64 first = blocks[i].index*slab->capacity;
+		slab->used = (slab_objects[k] - first < slab->capacity)?(slab_objects[k] - first):slab->capacity;
+		for (uint64 s=0; s<slab->capacity; ++s) {
+			db_bucket *slot_tag = (db_bucket*)get_slab_slot(slab, s);
+			slot_tag->order = SLAB_TAG_ORDER + k;
+			slot_tag->free  = 0;
+			if (s < slab->used)
+				slab->bitmap[s/64] |= 1ULL << (s%64);
+		}
+	}
+	for (size_t i=0; i<object_count; ++i)
+		memcpy(db_unmarshal(db, objects[i].new), buffer + objects[i].buffer_offset, objects[i].size);
+
+	for (int i=0; i<BUCKET_COUNT; ++i)
+		db->header->buckets[i] = 0;
+	db->header->master_pointer = master_pointer;
+	db->header->slabs          = 0;
+	db->header->bucket_count   = bucket_count;
+	db->header->size           = sizeof(db_header) + space;
+	db_invalidate_region(db, db->header, sizeof(db_header) - sizeof(uchar) + used_space);
+
+	// Return the rest of the space to the free lists, in naturally aligned buckets
+	position = used_space;
+	while (position < space) {
+		int order = 0;
+		while (order+1 < bucket_count && position % bucket_size(order+1) == 0 &&
+		       position + bucket_size(order+1) <= space)
+			++order;
+		db_bucket *bucket = (db_bucket*)(db->bucket0 + position);
+		bucket->order = order;
+		bucket->free  = 1;
+		insert_bucket(db, bucket);
+		position += bucket_size(order);
+	}
+
+	// Pages that are not full go back into the slab lists
+	for (size_t i=0; i<block_count; ++i) {
+		if (blocks[i].size_class < 0)
+			continue;
+		db_slab *slab = (db_slab*)(db->bucket0 + blocks[i].position + sizeof(uchar));
+		if (slab->used < slab->capacity)
+			slab_list_insert(db, get_slab_lists(db), slab);
+	}
+
+	db_commit(db);
+	db_flush(db);
+	db_checkpoint(db);
+
+	if (ftruncate(db->fd, sizeof(db_header) + bucket_size(db->header->bucket_count-1)) < 0)
+		perror("Compaction: Could not truncate database");
+
+	result = 0;
+
+	for (int k=0; k<DB_SLAB_CLASS_COUNT; ++k)
+		free(page_positions[k]);
+
+cleanup:
+	free(objects);
+	free(blocks);
+	free(buffer);
+	array_reset(&c->objects);
+	array_reset(&c->pointers);
+	return result;
+}
+
+static void db_init(db_obj *db)
+{
+	uint64 size = sizeof(db_header);
+	fallocate(db->fd, 0, 0, size);
+
+	db_begin_transaction(db);
+
+	#if 0
+	// For debugging: Initialize whole file with "random" data
+	{
+		uint64 s = 0x4412457309583741;
+		uint64 r = s;
+		uint64 *p = (uint64*)db->header;
+		for (int64 i=0; i<size/sizeof(uint64); ++i) {
+			*p = r;
+			r = r*s + s;
+			++p;
+		}
+	}
+	db_invalidate_region(db, db->header, size);
+	#endif
+
+	byte_zero(db->header, sizeof(db_header));
+
+	db->header->size = size;
+	db->header->bucket_count = 0;
+	db_invalidate_region(db, db->header, sizeof(db_header));
+
+	db_commit(db);
+}
+
+static void db_grow(db_obj *db)
+{
+	uint64 order = db->header->bucket_count;
+	reserve_written_pages(db, sizeof(db_header) + bucket_size(order));
+	if (order == 0) {
+		fallocate(db->fd, 0, 0, sizeof(db_header) + bucket_size(0));
+		db_bucket *bucket=(db_bucket*)db->bucket0;
+		bucket->order = 0;
+		bucket->free = 1;
+		insert_bucket(db,bucket);
+	} else {
+		uint64 s = bucket_size(order-1);
+		fallocate(db->fd, 0, 0, sizeof(db_header) + 2*s);
+
+		db_bucket *bucket = (db_bucket*)(db->bucket0 + s);
+		bucket->order = order-1;
+		bucket->free = 1;
+		db_invalidate_region(db, bucket, 1);
+
+		insert_bucket(db, bucket);
+		merge_buckets(db, bucket);
+
+	}
+	++(db->header->bucket_count);
+	db->header->size = sizeof(db_header) + bucket_size(order);
+	db_invalidate_region(db, &db->header->size, sizeof(uint64));
+	db_invalidate_region(db, &db->header->bucket_count, sizeof(uint64));
+}
+
+// Applies the frames in the first length bytes of the journal to the database file.
+// The journal is read through a single mapping. If verify is set, the frames are checked before
+// they are applied and the replay stops at the first frame that is incomplete, damaged or out of
+// sequence. Returns the length of the part of the journal that was applied.
+static int64 db_replay_journal(db_obj *db, int64 length, int verify)
+{
+	char *journal = mmap(0, length, PROT_READ, MAP_SHARED, db->journal_fd, 0);
+	if (journal == MAP_FAILED) {
+		perror("Could not map journal");
+		return 0;
+	}
+
+	int64 offset = 0;
+	uint64 sequence = 0;
+
+	while (length - offset >= (int64)sizeof(journal_frame_header)) {
+		journal_frame_header *frame = (journal_frame_header*)(journal + offset);
+		char *records = journal + offset + sizeof(journal_frame_header);
+
+		if (verify) {
+			if (frame->magic != JOURNAL_MAGIC)
+				break;
+			if (frame->length > length - offset - sizeof(journal_frame_header))
+				break;
+			if (offset > 0 && frame->sequence != sequence + 1)
+				break;
+			uint32 crc = crc32c(0, &frame->sequence, sizeof(frame->sequence) + sizeof(frame->length));
+			crc = crc32c(crc, records, frame->length);
+			if (crc != frame->checksum)
+				break;
+		}
+
+		uint64 pos = 0;
+		while (pos < frame->length) {
+			journal_write_header *record = (journal_write_header*)(records + pos);
+			pos += sizeof(journal_write_header);
+			if (record->type == JOURNAL_WRITE) {
+				byte_copy(db->shared_map + record->ptr, record->size, records + pos);
+				db_dirty_insert(&db->replayed_regions, record->ptr, record->size);
+			}
+			pos += record->size;
+		}
+
+		sequence = frame->sequence;
+		offset += sizeof(journal_frame_header) + frame->length;
+	}
+
+	munmap(journal, length);
+	return offset;
+}
+
+// Restores the before-images in the first length bytes of an undo log, undoing the transaction
+// that was in progress. A damaged frame can only be the last one: its page was not modified yet,
+// because the page is only written after the frame is on disk.
+static void db_rollback_journal(db_obj *db, int64 length)
+{
+	char *journal = mmap(0, length, PROT_READ, MAP_SHARED, db->journal_fd, 0);
+	if (journal == MAP_FAILED) {
+		perror("Could not map journal");
+		return;
+	}
+
+	array frames;
+	byte_zero(&frames, sizeof(array));
+	int64 offset = 0;
+	while (length - offset >= (int64)sizeof(journal_frame_header)) {
+		journal_frame_header *frame = (journal_frame_header*)(journal + offset);
+		char *records = journal + offset + sizeof(journal_frame_header);
+		if (frame->magic != UNDO_MAGIC)
+			break;
+		if (frame->length > length - offset - sizeof(journal_frame_header))
+			break;
+		uint32 crc = crc32c(0, &frame->sequence, sizeof(frame->sequence) + sizeof(frame->length));
+		crc = crc32c(crc, records, frame->length);
+		if (crc != frame->checksum)
+			break;
+
+		*(int64*)array_allocate(&frames, sizeof(int64), array_length(&frames, sizeof(int64))) = offset;
+		offset += sizeof(journal_frame_header) + frame->length;
+	}
+
+	// Restore in reverse order, so the oldest image of a page wins
+	for (int64 i=array_length(&frames, sizeof(int64))-1; i>=0; --i) {
+		journal_frame_header *frame = (journal_frame_header*)(journal + *(int64*)array_get(&frames, sizeof(int64), i));
+		char *records = (char*)frame + sizeof(journal_frame_header);
+		uint64 pos = 0;
+		while (pos < frame->length) {
+			journal_write_header *record = (journal_write_header*)(records + pos);
+			pos += sizeof(journal_write_header);
+			if (record->type == JOURNAL_WRITE) {
+				byte_copy(db->shared_map + record->ptr, record->size, records + pos);
+				db_dirty_insert(&db->replayed_regions, record->ptr, record->size);
+			}
+			pos += record->size;
+		}
+	}
+
+	array_reset(&frames);
+	munmap(journal, length);
+}
+
+// Writes the replayed changes back to the database file and empties the journal.
+static int db_truncate_journal(db_obj *db)
+{
+	if (db_sync_replayed_regions(db) != 0)
+		return -1;
+
+	ftruncate(db->journal_fd, 0);
+	fsync(db->journal_fd);
+	db->journal_size = 0;
+	return 0;
+}
+
+// Copies all committed transactions from the journal into the database file and empties the
+// journal.
+int db_checkpoint(db_obj *db)
+{
+	// The undo log is discarded at every flush, there is nothing to copy
+	if (db->undo_log)
+		return 0;
+
+	if (db->journal_size == 0)
+		return 0;
+
+	// Everything up to journal_size was written and synced by us, no need to verify it again
+	begin_write(db);
+	db_replay_journal(db, db->journal_size, 0);
+	end_write(db);
+	return db_truncate_journal(db);
+}
+
+// --- Concurrent readers ---
+// Other processes may read the database file through their own mapping while this process keeps
+// modifying it. The generation counter works like a seqlock: it is odd while the file is being
+// written. A reader remembers the counter before it starts and discards what it has read if the
+// counter has changed in the meantime.
+
+void db_set_generation_counter(db_obj *db, volatile uint64 *counter)
+{
+	db->generation = counter;
+}
+
+static void begin_write(db_obj *db)
+{
+	if (!db->generation || (*db->generation & 1))
+		return;
+	++*db->generation;
+	__sync_synchronize();
+}
+
+static void end_write(db_obj *db)
+{
+	if (!db->generation || !(*db->generation & 1))
+		return;
+	__sync_synchronize();
+	++*db->generation;
+}
+
+uint64 db_read_begin(db_obj *db)
+{
+	if (!db->generation)
+		return 0;
+	uint64 generation;
+	while ((generation = *db->generation) & 1)
+		sched_yield();
+	__sync_synchronize();
+	return generation;
+}
+
+int db_read_retry(db_obj *db, uint64 generation)
+{
+	if (!db->generation)
+		return 0;
+	__sync_synchronize();
+	return *db->generation != generation;
+}
+
+int db_contains(db_obj *db, const void *ptr)
+{
+	return (const char*)ptr >= db->priv_map && (const char*)ptr < db->priv_map + MAP_SIZE;
+}
+
+// Asks the kernel to read the whole database ahead and to back the mapping with transparent huge
+// pages where the file system supports them. Errors are ignored, these are only hints.
+void db_prefault(db_obj *db)
+{
+	#ifdef MADV_HUGEPAGE
+	// Covers the whole mapping, so the hint also applies when the database grows
+	madvise(db->priv_map, MAP_SIZE, MADV_HUGEPAGE);
+	#endif
+	madvise(db->priv_map, db->header->size, MADV_WILLNEED);
+}
+
+void db_set_wal(db_obj *db, int enabled)
+{
+	if (enabled && db->undo_log) {
+		fprintf(stderr, "The write-ahead log cannot be used together with the undo log\n");
+		return;
+	}
+	if (!enabled)
+		db_checkpoint(db);
+	db->wal = enabled;
+}
+
+uint64 db_journal_size(db_obj *db)
+{
+	return db->journal_size;
+}
+
+// Writes the pages touched by the replay back to the database file.
+// The cost only depends on the size of the change, not on the size of the database.
+static int db_sync_replayed_regions(db_obj *db)
+{
+	array_trunc(&db->regions);
+	db_dirty_regions(&db->replayed_regions, &db->regions);
+
+	size_t count = array_length(&db->regions, sizeof(db_region));
+	db_region *regions = array_start(&db->regions);
+	const db_ptr page_size = sysconf(_SC_PAGESIZE);
+	int result = 0;
+
+	size_t i=0;
+	while (i<count) {
+		// msync needs a page aligned address
+		db_ptr start = regions[i].start & ~(page_size-1);
+		db_ptr end   = regions[i].end;
+		++i;
+		// Merge with following regions that touch the same or adjacent pages
+		while (i<count && (regions[i].start & ~(page_size-1)) <= end) {
+			if (regions[i].end > end)
+				end = regions[i].end;
+			++i;
+		}
+
+		if (msync(db->shared_map + start, end - start, MS_SYNC) != 0) {
+			perror("msync");
+			result = -1;
+		}
+	}
+
+	for (i=0; i<count; ++i)
+		snapshot_track(db, regions[i].start, regions[i].end - regions[i].start);
+
+	db_dirty_clear(&db->replayed_regions);
+	return result;
+}
+
+
+// Writes all buffers, in chunks of at most IOV_MAX.
+static int write_iov(int fd, struct iovec *iov, size_t count)
+{
+	while (count > 0) {
+		int n = (count > IOV_MAX)?IOV_MAX:count;
+		ssize_t written = writev(fd, iov, n);
+		if (written < 0)
+			return -1;
+
+		// Skip completely written buffers, adjust the partially written one
+		while (count > 0 && written >= (ssize_t)iov->iov_len) {
+			written -= iov->iov_len;
+			++iov;
+			--count;
+		}
+		if (count > 0) {
+			iov->iov_base = (char*)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	return 0;
+}
+
+static void db_record_commit_size(db_obj *db, uint64 region_count)
+{
+	int i=0;
+	while (i<DB_HISTOGRAM_SIZE-1 && (region_count >> (i+1)) > 0)
+		++i;
+	++db->stats.commit_histogram[i];
 }
 
+static uint64 now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64)ts.tv_sec*1000000ULL + ts.tv_nsec/1000;
+}
+
+void db_get_stats(db_obj *db, db_stats *stats)
+{
+	*stats = db->stats;
+
+	stats->file_size = lseek(db->fd, 0, SEEK_END);
+	stats->space     = db->header->bucket_count?bucket_size(db->header->bucket_count-1):0;
+
+	for (int i=0; i<BUCKET_COUNT; ++i) {
+		for (db_bucket *bucket = get_bucket(db, i); bucket; bucket = db_unmarshal(db, bucket->next)) {
+			++stats->free_buckets[i];
+			stats->free_bytes += bucket_size(i);
+			if (bucket_size(i) > stats->largest_free_block)
+				stats->largest_free_block = bucket_size(i);
+		}
+	}
+	stats->allocated_bytes = stats->space - stats->free_bytes;
+
+	if (db->header->slabs) {
+		db_ptr *lists = db_unmarshal(db, db->header->slabs);
+		for (int k=0; k<DB_SLAB_CLASS_COUNT; ++k) {
+			for (db_slab *slab = db_unmarshal(db, lists[k]); slab; slab = db_unmarshal(db, slab->next)) {
+				++stats->slab_partial_pages[k];
+				stats->slab_free_slots[k] += slab->capacity - slab->used;
+			}
+		}
+	}
+}
+
+void db_print_stats(db_obj *db)
+{
+	db_stats stats;
+	db_get_stats(db, &stats);
+
+	printf("File size:          %llu\n", (unsigned long long)stats.file_size);
+	printf("Allocated:          %llu\n", (unsigned long long)stats.allocated_bytes);
+	printf("Free:               %llu\n", (unsigned long long)stats.free_bytes);
+	printf("Largest free block: %llu\n", (unsigned long long)stats.largest_free_block);
+	printf("Free buckets (size: count):\n");
+	for (int i=0; i<BUCKET_COUNT; ++i) {
+		if (stats.free_buckets[i])
+			printf("  %12llu: %llu\n", (unsigned long long)bucket_size(i), (unsigned long long)stats.free_buckets[i]);
+	}
+	printf("Partially used slab pages (slot size: pages, free slots):\n");
+	for (int k=0; k<DB_SLAB_CLASS_COUNT; ++k) {
+		if (stats.slab_partial_pages[k])
+			printf("  %12llu: %llu, %llu\n", (unsigned long long)slab_slot_size(k),
+			       (unsigned long long)stats.slab_partial_pages[k], (unsigned long long)stats.slab_free_slots[k]);
+	}
+	printf("Since the database was opened:\n");
+	printf("  Bytes requested:  %llu\n", (unsigned long long)stats.bytes_requested);
+	printf("  Bytes allocated:  %llu\n", (unsigned long long)stats.bytes_allocated);
+	printf("  Transactions:     %llu\n", (unsigned long long)stats.transactions);
+	printf("  Journal writes:   %llu\n", (unsigned long long)stats.flushes);
+	printf("  Journal bytes:    %llu\n", (unsigned long long)stats.journal_bytes);
+	if (stats.flushes) {
+		printf("  Bytes per write:  %llu\n", (unsigned long long)(stats.journal_bytes/stats.flushes));
+		printf("  Write latency:    %llu us average, %llu us max\n",
+		       (unsigned long long)(stats.flush_time/stats.flushes), (unsigned long long)stats.max_flush_time);
+	}
+	printf("Commit size histogram (regions per commit):\n");
+	for (int i=0; i<DB_HISTOGRAM_SIZE; ++i) {
+		if (!stats.commit_histogram[i])
+			continue;
+		printf("  %8llu - %8llu: %llu\n",
+		       (unsigned long long)((1ULL << i) & ~1ULL), (unsigned long long)((1ULL << (i+1)) - 1),
+		       (unsigned long long)stats.commit_histogram[i]);
+	}
+}
 
 void db_commit(db_obj *db)
 {
@@ -541,69 +1773,602 @@ void db_commit(db_obj *db)
 	if (!db->changed)
 		return;
 
-	// Sort dirty regions
-	qsort(array_start(&db->dirty_regions),
-	      array_length(&db->dirty_regions, sizeof(db_region_boundary)),
-	      sizeof(db_region_boundary),
-	      region_boundary_comp);
-
-	lseek(db->journal_fd, 0, SEEK_END);
-
-	// Write changes to log, skip duplicate regions
-	db_ptr region_start = ~0L;
-	int64 nesting=0;
-	for (int i=0; i<array_length(&db->dirty_regions, sizeof(db_region_boundary)); ++i) {
-		db_region_boundary *region = array_get(&db->dirty_regions, sizeof(db_region_boundary), i);
-		if (region->type == DB_REGION_START) {
-			if (likely(nesting == 0))
-				region_start = region->position;
-			++nesting;
-		} else {
-			--nesting;
-			assert(likely(nesting >= 0));
-			assert(likely(region_start != ~0L));
-			if (likely(nesting == 0)) {
-				db_ptr region_end  = region->position;
-				db_ptr region_size = region_end - region_start;
-
-				journal_entry_type type = JOURNAL_WRITE;
-				//printf("Invalidate %x - %x (%d)\n", (int)region_start, (int)region_end, (int)region_size);
-				if (unlikely(write(db->journal_fd, &type, sizeof(journal_entry_type)) < (ssize_t)sizeof(journal_entry_type)))
-					goto fail;
-				if (unlikely(write(db->journal_fd, &region_start, sizeof(db_ptr)) < (ssize_t)sizeof(db_ptr)))
-					goto fail;
-				if (unlikely(write(db->journal_fd, &region_size, sizeof(uint64)) < (ssize_t)sizeof(uint64)))
-					goto fail;
-				if (unlikely(write(db->journal_fd, db->priv_map + region_start, region_size) < (ssize_t)region_size))
-					goto fail;
-			}
-		}
+	++db->stats.transactions;
+
+	if (db->group_commit) {
+		// The changes stay in the private mapping and are written by the next db_flush()
+		// together with all other transactions committed in the meantime.
+		++db->pending_commits;
+		return;
 	}
 
-	assert(likely(nesting == 0));
+	db_flush(db);
+}
+
+void db_set_group_commit(db_obj *db, int enabled)
+{
+	if (!enabled && db->pending_commits > 0)
+		db_flush(db);
+	db->group_commit = enabled;
+}
+
+int db_flush_pending(db_obj *db)
+{
+	return db->pending_commits > 0;
+}
+
+// Flush in undo log mode: the changes are already in the shared mapping, so they only need to be
+// synced. Discarding the undo log afterwards commits the transaction.
+static int db_flush_undo(db_obj *db)
+{
+	uint64 start_time = now_us();
+
+	uint64 sequence = db->sequence + 1;
+	db->header->sequence = sequence;
+
+	uint64 pages = 0;
+	uint64 page = 0;
+	uint64 count;
+	while (next_written_run(db, &page, &count)) {
+		snapshot_track(db, page*db->page_size, count*db->page_size);
+		pages += count;
+		page += count;
+	}
+	if (db->written_overflow)
+		snapshot_track(db, 0, db->header->size);
+	db_record_commit_size(db, pages);
+
+	// Readers see the changes as soon as they are made, they can only be told when they are
+	// complete
+	end_write(db);
 
-	if (fsync(db->journal_fd) == -1) {
+	// Also writes back the file size in case the database has grown
+	if (fdatasync(db->fd) == -1) {
 		perror("FAIL, COULD NOT FSYNC");
-		return;
+		return -1;
+	}
+
+	uint64 journal_bytes = db->journal_size;
+	if (ftruncate(db->journal_fd, 0) == -1 || fdatasync(db->journal_fd) == -1) {
+		perror("Could not discard undo log");
+		return -1;
+	}
+	db->journal_size = 0;
+	db->sequence = sequence;
+	db->changed = 0;
+
+	uint64 flush_time = now_us() - start_time;
+	++db->stats.flushes;
+	db->stats.journal_bytes += journal_bytes;
+	db->stats.flush_time += flush_time;
+	if (flush_time > db->stats.max_flush_time)
+		db->stats.max_flush_time = flush_time;
+
+	protect_written_pages(db);
+	return 0;
+}
+
+// Returns -1 if the transactions could not be made durable. They stay pending and are written
+// again by the next call.
+int db_flush(db_obj *db)
+{
+	// Cannot write a transaction that is still in progress
+	assert(db->transactions == 0);
+
+	if (!db->changed) {
+		db->pending_commits = 0;
+		return 0;
 	}
 
-	journal_entry_type type = JOURNAL_COMMIT;
-	write(db->journal_fd, &type, sizeof(journal_entry_type));
+	if (db->undo_log) {
+		if (db_flush_undo(db) != 0)
+			goto fail;
+		db->pending_commits = 0;
+		return 0;
+	}
+
+	uint64 start_time = now_us();
+
+	// The sequence number is part of the transaction, so the database file always knows which
+	// transaction it was last brought up to date with
+	uint64 sequence = db->sequence + 1;
+	db->header->sequence = sequence;
+	db_invalidate_region(db, &db->header->sequence, sizeof(uint64));
+
+	if (db->write_tracking)
+		collect_written_pages(db);
+
+	// Build the journal record for all changes. The tracker has already merged overlapping
+	// regions.
+	array_trunc(&db->regions);
+	db_dirty_regions(&db->dirty_regions, &db->regions);
+
+	array_trunc(&db->journal_headers);
+	uint64 record_size = 0;
+	size_t dirty_count = array_length(&db->regions, sizeof(db_region));
+	for (size_t i=0; i<dirty_count; ++i) {
+		db_region *region = array_get(&db->regions, sizeof(db_region), i);
+		journal_write_header *header = array_allocate(&db->journal_headers, sizeof(journal_write_header), i);
+		header->type = JOURNAL_WRITE;
+		header->ptr  = region->start;
+		header->size = region->end - region->start;
+		record_size += sizeof(journal_write_header) + header->size;
+	}
+
+	// The headers array is complete now, so it is safe to take pointers into it
+	journal_frame_header frame;
+	frame.magic    = JOURNAL_MAGIC;
+	frame.sequence = sequence;
+	frame.length   = record_size;
+	uint32 crc = crc32c(0, &frame.sequence, sizeof(frame.sequence) + sizeof(frame.length));
+
+	size_t region_count = array_length(&db->journal_headers, sizeof(journal_write_header));
+	array_trunc(&db->journal_iov);
+	// Allocate the last element first, so the array does not move while it is filled
+	array_allocate(&db->journal_iov, sizeof(struct iovec), 2*region_count);
+	struct iovec *iov = array_start(&db->journal_iov);
+	iov[0].iov_base = &frame;
+	iov[0].iov_len  = sizeof(journal_frame_header);
+	for (size_t i=0; i<region_count; ++i) {
+		journal_write_header *header = array_get(&db->journal_headers, sizeof(journal_write_header), i);
+		iov[2*i+1].iov_base = header;
+		iov[2*i+1].iov_len  = sizeof(journal_write_header);
+		iov[2*i+2].iov_base = db->priv_map + header->ptr;
+		iov[2*i+2].iov_len  = header->size;
+		crc = crc32c(crc, header, sizeof(journal_write_header));
+		crc = crc32c(crc, db->priv_map + header->ptr, header->size);
+	}
+	frame.checksum = crc;
+
+	db_record_commit_size(db, region_count);
 
-	db_replay_journal(db);
+	// Overwrite anything left behind by a failed write
+	lseek(db->journal_fd, db->journal_size, SEEK_SET);
 
-	if (msync(db->shared_map, db->header->size, MS_SYNC) == 0) {
-		lseek(db->journal_fd, 0, SEEK_SET);
-		ftruncate(db->journal_fd, 0);
-		fsync(db->journal_fd);
+	if (unlikely(write_iov(db->journal_fd, array_start(&db->journal_iov), 2*region_count+1) < 0)) {
+		perror("Error writing journal");
+		goto fail;
+	}
 
+	// A torn frame fails the checksum on recovery, so a single sync is enough to make the
+	// transaction durable
+	if (fdatasync(db->journal_fd) == -1) {
+		perror("FAIL, COULD NOT FSYNC");
+		goto fail;
+	}
+
+	db->sequence = sequence;
+	db->journal_size += sizeof(journal_frame_header) + record_size;
+
+	if (db->archive_dir)
+		archive_frame(db, sequence, array_start(&db->journal_iov), 2*region_count+1);
+
+	if (db->wal) {
+		// The database file is updated later by db_checkpoint()
 		db->changed = 0;
+	} else {
+		if (db_checkpoint(db) == 0)
+			db->changed = 0;
 	}
 
-	array_trunc(&db->dirty_regions);
-	return;
+	uint64 flush_time = now_us() - start_time;
+	++db->stats.flushes;
+	db->stats.journal_bytes += sizeof(journal_frame_header) + record_size;
+	db->stats.flush_time += flush_time;
+	if (flush_time > db->stats.max_flush_time)
+		db->stats.max_flush_time = flush_time;
+
+	db_dirty_clear(&db->dirty_regions);
+	if (db->write_tracking)
+		protect_written_pages(db);
+	db->pending_commits = 0;
+	return 0;
 
 fail:
-	perror("Error writing journal");
-	return;
+	// Also keeps a transaction committed without group commit pending, see db_flush_pending()
+	if (!db->pending_commits)
+		db->pending_commits = 1;
+	return -1;
+}
+
+// --- Snapshots ---
+// A snapshot is a consistent copy of the database file that is made while the server keeps
+// running. If the file system supports reflinks, the file is simply cloned. Otherwise the file is
+// copied in small steps between requests. Every region of the file that changes in the meantime
+// is recorded and copied again in another pass. Once a pass is small enough to be copied within a
+// single step, the copy is consistent and the snapshot is complete.
+
+// Number of bytes copied per step. Bounds the time a step blocks the caller.
+#define SNAPSHOT_STEP_SIZE (4*1024*1024)
+
+static void snapshot_track(db_obj *db, int64 start, uint64 size)
+{
+	if (db->snapshot.fd >= 0 && size > 0)
+		db_dirty_insert(&db->snapshot.changed, start, size);
+}
+
+static void snapshot_end(db_obj *db, int success)
+{
+	db_snapshot *snap = &db->snapshot;
+	if (snap->fd >= 0)
+		close(snap->fd);
+	if (success) {
+		if (rename(snap->temp_path, snap->path) == 0)
+			printf("Snapshot written to %s\n", snap->path);
+		else
+			perror("Could not rename snapshot");
+	} else {
+		unlink(snap->temp_path);
+	}
+	free(snap->path);
+	free(snap->temp_path);
+	snap->path = 0;
+	snap->temp_path = 0;
+	snap->fd = -1;
+	array_reset(&snap->pass);
+	db_dirty_clear(&snap->changed);
+}
+
+static int snapshot_finish(db_obj *db)
+{
+	db_snapshot *snap = &db->snapshot;
+	// The database may have grown since the pass started
+	if (ftruncate(snap->fd, lseek(db->fd, 0, SEEK_END)) == -1 ||
+	    fdatasync(snap->fd) == -1) {
+		perror("Could not write snapshot");
+		return -1;
+	}
+	return 0;
+}
+
+static int snapshot_start(db_obj *db)
+{
+	db_snapshot *snap = &db->snapshot;
+
+	// The file must contain all committed transactions
+	if (db_checkpoint(db) != 0)
+		return -1;
+
+	snap->fd = open(snap->temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (snap->fd < 0) {
+		perror("Could not create snapshot");
+		return -1;
+	}
+
+	#ifdef FICLONE
+	if (ioctl(snap->fd, FICLONE, db->fd) == 0)
+		return 1;
+	#endif
+
+	array_trunc(&snap->pass);
+	db_region *region = array_allocate(&snap->pass, sizeof(db_region), 0);
+	region->start = 0;
+	region->end   = lseek(db->fd, 0, SEEK_END);
+	snap->index  = 0;
+	snap->offset = 0;
+	db_dirty_clear(&snap->changed);
+	return 0;
+}
+
+// Requests a snapshot of the database, which is written to path. The copy is made by
+// db_snapshot_step(), which has to be called regularly after the transactions have been flushed.
+// Returns -1 if another snapshot is still in progress.
+int db_snapshot_begin(db_obj *db, const char *path)
+{
+	db_snapshot *snap = &db->snapshot;
+	if (snap->path)
+		return -1;
+	snap->path = strdup(path);
+	snap->temp_path = malloc(strlen(path) + strlen(".tmp") + 1);
+	strcpy(snap->temp_path, path);
+	strcat(snap->temp_path, ".tmp");
+	return 0;
+}
+
+int db_snapshot_pending(db_obj *db)
+{
+	return db->snapshot.path != 0;
+}
+
+void db_snapshot_step(db_obj *db)
+{
+	db_snapshot *snap = &db->snapshot;
+	if (!snap->path)
+		return;
+
+	// Only copy the file while no transaction is waiting to be written, otherwise the regions it
+	// changes are not recorded yet.
+	if (db->transactions > 0 || db->pending_commits > 0 || db->changed)
+		return;
+
+	if (snap->fd < 0) {
+		int result = snapshot_start(db);
+		if (result < 0)
+			snapshot_end(db, 0);
+		else if (result > 0)
+			snapshot_end(db, snapshot_finish(db) == 0);
+		return;
+	}
+
+	int64 budget = SNAPSHOT_STEP_SIZE;
+	while (1) {
+		size_t count = array_length(&snap->pass, sizeof(db_region));
+		if (snap->index == count) {
+			// Pass complete, copy everything that changed in the meantime
+			if (db_checkpoint(db) != 0) {
+				snapshot_end(db, 0);
+				return;
+			}
+			array_trunc(&snap->pass);
+			db_dirty_regions(&snap->changed, &snap->pass);
+			db_dirty_clear(&snap->changed);
+			snap->index  = 0;
+			snap->offset = 0;
+
+			int64 total = 0;
+			count = array_length(&snap->pass, sizeof(db_region));
+			for (size_t i=0; i<count; ++i) {
+				db_region *region = array_get(&snap->pass, sizeof(db_region), i);
+				total += region->end - region->start;
+			}
+			if (total == 0) {
+				// Nothing changed during the pass, the copy is consistent
+				snapshot_end(db, snapshot_finish(db) == 0);
+				return;
+			}
+			// Start the next pass with a full budget, so a small pass completes in one step
+			if (total > budget)
+				return;
+		}
+		if (budget <= 0)
+			return;
+
+		db_region *region = array_get(&snap->pass, sizeof(db_region), snap->index);
+		int64 pos = region->start + snap->offset;
+		int64 n = region->end - pos;
+		if (n > budget)
+			n = budget;
+
+		if (pwrite(snap->fd, db->shared_map + pos, n, pos) != n) {
+			perror("Could not write snapshot");
+			snapshot_end(db, 0);
+			return;
+		}
+		// Start writing back now, so the final sync does not block for long
+		sync_file_range(snap->fd, pos, n, SYNC_FILE_RANGE_WRITE);
+
+		budget -= n;
+		snap->offset += n;
+		if (region->start + snap->offset >= region->end) {
+			++snap->index;
+			snap->offset = 0;
+		}
+	}
+}
+
+// --- Replication ---
+// The primary copies every frame it writes to the journal into an archive directory. The archive
+// consists of segments, each named after the sequence number of its first frame. A replica
+// starts from a copy of the database (e.g. a snapshot) and applies all frames that follow the
+// sequence number in its header. The frames are applied as ordinary transactions, so the replica
+// is crash safe and writes the same sequence numbers to its own journal.
+// Segments are never removed. A segment is no longer needed once every replica has applied the
+// frame before the first one of the next segment, and no replica will be seeded from a snapshot
+// older than that. Removing it is up to the administrator.
+
+// Size after which the primary starts a new segment
+#define ARCHIVE_SEGMENT_SIZE (64*1024*1024)
+
+static char* archive_segment_path(const char *dir, uint64 first_sequence)
+{
+	char *path = malloc(strlen(dir) + 1 + 16 + strlen(".journal") + 1);
+	sprintf(path, "%s/%016llx.journal", dir, (unsigned long long)first_sequence);
+	return path;
+}
+
+static int open_archive_segment(db_obj *db, uint64 first_sequence)
+{
+	if (db->archive_fd >= 0) {
+		fdatasync(db->archive_fd);
+		close(db->archive_fd);
+	}
+
+	// A segment starting at a sequence number that was never committed only contains the
+	// remains of a crash, so it is overwritten.
+	char *path = archive_segment_path(db->archive_dir, first_sequence);
+	db->archive_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+	free(path);
+	db->archive_size = 0;
+	if (db->archive_fd < 0) {
+		perror("Could not open journal archive");
+		return -1;
+	}
+	return 0;
+}
+
+// Makes the primary copy every transaction to dir, from which replicas read them.
+// Not supported with the undo log, which does not write the changes to the journal.
+int db_set_archive(db_obj *db, const char *dir)
+{
+	if (db->undo_log) {
+		fprintf(stderr, "The journal cannot be archived when the undo log is used\n");
+		return -1;
+	}
+	mkdir(dir, 0755);
+	db->archive_dir = strdup(dir);
+	return open_archive_segment(db, db->sequence + 1);
+}
+
+// The archive is not synced with every frame. If the primary crashes right after a commit, the
+// last frames may be missing from the archive, which the replicas report as a gap.
+static void archive_frame(db_obj *db, uint64 sequence, struct iovec *iov, size_t count)
+{
+	if (db->archive_fd < 0 || db->archive_size >= ARCHIVE_SEGMENT_SIZE) {
+		if (open_archive_segment(db, sequence) != 0)
+			return;
+	}
+
+	uint64 size = 0;
+	for (size_t i=0; i<count; ++i)
+		size += iov[i].iov_len;
+	if (write_iov(db->archive_fd, iov, count) < 0) {
+		perror("Could not write journal archive");
+		// Do not append to a torn frame
+		close(db->archive_fd);
+		db->archive_fd = -1;
+		return;
+	}
+	db->archive_size += size;
+}
+
+// Finds the segment that contains the frame with the given sequence number: the one with the
+// highest first sequence number not above it. Sets later if there is a segment that starts after
+// the frame, in which case the frame never arrives if it is not in the segment.
+static int find_archive_segment(const char *dir, uint64 sequence, uint64 *first_sequence, int *later)
+{
+	*later = 0;
+	DIR *d = opendir(dir);
+	if (!d)
+		return -1;
+	int found = 0;
+	struct dirent *entry;
+	while ((entry = readdir(d))) {
+		unsigned long long first;
+		char suffix[16];
+		if (sscanf(entry->d_name, "%16llx%15s", &first, suffix) != 2 || strcmp(suffix, ".journal") != 0)
+			continue;
+		if (first <= sequence && (!found || first > *first_sequence)) {
+			*first_sequence = first;
+			found = 1;
+		}
+		if (first > sequence)
+			*later = 1;
+	}
+	closedir(d);
+	return found?0:-1;
+}
+
+static int follow_segment(db_obj *db, const char *dir, uint64 first_sequence)
+{
+	char *path = archive_segment_path(dir, first_sequence);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+	if (fd < 0)
+		return -1;
+	if (db->follow_fd >= 0)
+		close(db->follow_fd);
+	db->follow_fd = fd;
+	db->follow_first = first_sequence;
+	db->follow_offset = 0;
+	return 0;
+}
+
+// Applies a verified frame as a transaction of its own.
+static void apply_frame(db_obj *db, journal_frame_header *frame, char *records)
+{
+	// The frame may write beyond the end of the file if the primary has grown
+	int64 end = 0;
+	for (uint64 pos = 0; pos < frame->length; ) {
+		journal_write_header *record = (journal_write_header*)(records + pos);
+		if (record->ptr + (int64)record->size > end)
+			end = record->ptr + record->size;
+		pos += sizeof(journal_write_header) + record->size;
+	}
+	if (end > lseek(db->fd, 0, SEEK_END)) {
+		reserve_written_pages(db, end);
+		fallocate(db->fd, 0, 0, end);
+	}
+
+	db_begin_transaction(db);
+	for (uint64 pos = 0; pos < frame->length; ) {
+		journal_write_header *record = (journal_write_header*)(records + pos);
+		pos += sizeof(journal_write_header);
+		if (record->type == JOURNAL_WRITE) {
+			byte_copy(db->priv_map + record->ptr, record->size, records + pos);
+			db_invalidate_region(db, db->priv_map + record->ptr, record->size);
+		}
+		pos += record->size;
+	}
+	// Keep the file as large as on the primary
+	if ((int64)db->header->size > lseek(db->fd, 0, SEEK_END)) {
+		reserve_written_pages(db, db->header->size);
+		fallocate(db->fd, 0, 0, db->header->size);
+	}
+	// Write the frame with the sequence number of the primary
+	db->sequence = frame->sequence - 1;
+	db_commit(db);
+}
+
+// Applies all frames from the archive in dir that the database does not contain yet. Incomplete
+// frames at the end of the archive are left for the next call.
+// Returns the number of applied frames, or -1 if a frame is missing from the archive.
+int db_follow_archive(db_obj *db, const char *dir)
+{
+	int applied = 0;
+
+	if (db->follow_fd < 0) {
+		uint64 first;
+		int later;
+		if (find_archive_segment(dir, db->sequence + 1, &first, &later) != 0) {
+			// The database is older than the whole archive
+			if (later) {
+				fprintf(stderr, "Transaction %llu is older than the journal archive\n",
+				        (unsigned long long)(db->sequence + 1));
+				return -1;
+			}
+			// Nothing has been archived yet
+			return 0;
+		}
+		if (follow_segment(db, dir, first) != 0)
+			return 0;
+	}
+
+	while (1) {
+		// With group commit, db->sequence is only advanced by the flush
+		uint64 expected = db->header->sequence + 1;
+
+		journal_frame_header frame;
+		ssize_t n = pread(db->follow_fd, &frame, sizeof(frame), db->follow_offset);
+		int complete = (n == sizeof(frame) && frame.magic == JOURNAL_MAGIC);
+		char *records = 0;
+		if (complete) {
+			records = malloc(frame.length);
+			complete = (pread(db->follow_fd, records, frame.length, db->follow_offset + sizeof(frame)) == (ssize_t)frame.length);
+			if (complete) {
+				uint32 crc = crc32c(0, &frame.sequence, sizeof(frame.sequence) + sizeof(frame.length));
+				crc = crc32c(crc, records, frame.length);
+				complete = (crc == frame.checksum);
+			}
+		}
+
+		if (!complete) {
+			free(records);
+			// Either the primary is still writing the frame or it has moved on to a new segment,
+			// which starts with the frame we are waiting for.
+			if (expected != db->follow_first && follow_segment(db, dir, expected) == 0)
+				continue;
+			// If the primary has started a segment after the frame, the frame was lost (the
+			// archive could not be written or the primary crashed before writing it)
+			uint64 first;
+			int later;
+			find_archive_segment(dir, expected, &first, &later);
+			if (later) {
+				fprintf(stderr, "Transaction %llu is missing from the journal archive\n", (unsigned long long)expected);
+				return -1;
+			}
+			return applied;
+		}
+
+		if (frame.sequence > expected) {
+			free(records);
+			fprintf(stderr, "Transaction %llu is missing from the journal archive\n", (unsigned long long)expected);
+			return -1;
+		}
+		if (frame.sequence == expected) {
+			apply_frame(db, &frame, records);
+			++applied;
+		}
+		free(records);
+		db->follow_offset += sizeof(frame) + frame.length;
+	}
 }
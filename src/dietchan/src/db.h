@@ -4,11 +4,20 @@
 #include<libowfat/array.h>
 #include<libowfat/uint32.h>
 #include<libowfat/uint64.h>
+#include "db_dirty.h"
 
 typedef int64 db_ptr;
 
 #define BUCKET_COUNT    56
 
+// Number of slab size classes. Objects of up to 16*DB_SLAB_CLASS_COUNT-1 bytes are allocated from
+// slab pages.
+#define DB_SLAB_CLASS_COUNT 16
+
+// Number of buckets of the commit size histogram. Bucket i counts commits with 2^i to 2^(i+1)-1
+// written regions.
+#define DB_HISTOGRAM_SIZE 24
+
 typedef unsigned char uchar;
 
 typedef struct db_bucket {
@@ -26,9 +35,43 @@ typedef struct db_header {
 	uint64 bucket_count;
 	db_ptr master_pointer;
 	db_ptr buckets[BUCKET_COUNT];
-	char _padding[7*8+8];
+	uint64 sequence; // Sequence number of the last transaction applied to the file
+	db_ptr slabs;    // Lists of slab pages with free slots, one per size class
+	char _padding[5*8+8];
 } db_header;
 
+// Allocator and journal statistics, see db_get_stats()
+typedef struct db_stats {
+	uint64 file_size;
+	uint64 space;              // Size of the area managed by the allocator
+	uint64 allocated_bytes;    // Including slab pages and the unused parts of buckets
+	uint64 free_bytes;
+	uint64 largest_free_block;
+	uint64 free_buckets[BUCKET_COUNT];              // Length of the free list of every order
+	uint64 slab_partial_pages[DB_SLAB_CLASS_COUNT]; // Slab pages with free slots
+	uint64 slab_free_slots[DB_SLAB_CLASS_COUNT];
+
+	// Counted since the database was opened
+	uint64 bytes_requested;    // Sizes passed to db_alloc() and db_realloc()
+	uint64 bytes_allocated;    // Usable sizes of the objects returned for them
+	uint64 transactions;
+	uint64 flushes;            // Number of journal writes
+	uint64 journal_bytes;
+	uint64 flush_time;         // Microseconds spent writing and syncing the journal
+	uint64 max_flush_time;
+	uint64 commit_histogram[DB_HISTOGRAM_SIZE];
+} db_stats;
+
+// Online snapshot in progress, see db_snapshot_begin()
+typedef struct db_snapshot {
+	char    *path;      // Requested file, 0 if there is no snapshot in progress
+	char    *temp_path; // The copy is written here and renamed when it is complete
+	int      fd;        // -1 until the copy has started
+	array    pass;      // Regions of the file to copy in the current pass (db_region)
+	size_t   index;     // Region that is being copied
+	int64    offset;    // Offset in that region
+	db_dirty changed;   // Regions of the file changed since the current pass started
+} db_snapshot;
 
 typedef struct db_obj {
 	int   fd;
@@ -37,15 +80,60 @@ typedef struct db_obj {
 	char *shared_map;
 	char *priv_map;
 	int   transactions;
-	array dirty_regions;
+	db_dirty dirty_regions;
+
+	int   group_commit;    // Defer writing the journal until db_flush() is called
+	int   pending_commits; // Number of committed transactions waiting for db_flush()
+	int   wal;             // Write-ahead log mode: defer copying the journal to db_checkpoint()
+	int64 journal_size;    // Length of the committed part of the journal
+	uint64 sequence;       // Sequence number of the last transaction written to the journal
+
+	array journal_headers; // Staging area for the record headers of the next journal write
+	array journal_iov;
+	db_dirty replayed_regions; // Regions of the shared map written by the last replay
+	array regions;             // Scratch space for db_dirty_regions()
+
+	db_stats stats;
+	db_snapshot snapshot;
+
+	char  *archive_dir;        // Primary: every frame is copied to this directory
+	int    archive_fd;         // Segment that is being written
+	uint64 archive_size;
+	int    follow_fd;          // Replica: segment that is being read
+	uint64 follow_first;       // First sequence number in that segment
+	int64  follow_offset;
+
+	int     undo_log;          // Single shared mapping with an undo log, see db_open_mode()
+	int     write_tracking;    // Find changes with write faults, see db_set_write_tracking()
+	uint64  page_size;
+	char   *shadow_map;        // Copies of the written pages as they were before the first write
+	uint64 *written_pages;     // Bitmap of the pages written since the last flush
+	uint64  written_capacity;  // Number of pages covered by the bitmap
+	int     written_overflow;  // A page outside of the bitmap was written, compare all pages
+
+	int     read_only;         // Mapped from another process, see DB_OPEN_READ_ONLY
+	volatile uint64 *generation; // Seqlock shared with readers, see db_set_generation_counter()
 
 	db_header *header;
 	char *bucket0;
 } db_obj;
 
+// Compaction, see db_compact_finish()
+typedef struct db_compaction {
+	db_obj *db;
+	array   objects;  // Position of every live object
+	array   pointers; // Position of every field that holds a db_ptr
+} db_compaction;
+
+// Flags for db_open_mode()
+#define DB_OPEN_UNDO_LOG  1 // Modify the file in place and keep the before-images in the journal
+#define DB_OPEN_READ_ONLY 2 // Read a database that is modified by another process
+
 db_obj* db_open(const char *file);
+db_obj* db_open_mode(const char *file, int flags);
 void*   db_alloc(db_obj *db, const uint64 size);
 void*   db_realloc(db_obj *db, void *ptr, uint64 new_size);
+void*   db_realloc_array(db_obj *db, void *ptr, uint64 new_size);
 db_ptr  db_marshal(db_obj *db, const void *ptr);
 void*   db_unmarshal(db_obj *db, const db_ptr ptr);
 void    db_free(db_obj *db, void *ptr);
@@ -55,5 +143,28 @@ void    db_begin_transaction(db_obj *db);
 void    db_invalidate(db_obj *db, void *ptr);
 void    db_invalidate_region(db_obj *db, void *ptr, const uint64 size);
 void    db_commit(db_obj *db);
+void    db_set_group_commit(db_obj *db, int enabled);
+int     db_flush_pending(db_obj *db);
+int     db_flush(db_obj *db);
+void    db_get_stats(db_obj *db, db_stats *stats);
+void    db_print_stats(db_obj *db);
+void    db_set_wal(db_obj *db, int enabled);
+int     db_set_write_tracking(db_obj *db, int enabled);
+void    db_prefault(db_obj *db);
+int     db_snapshot_begin(db_obj *db, const char *path);
+int     db_snapshot_pending(db_obj *db);
+void    db_snapshot_step(db_obj *db);
+int     db_set_archive(db_obj *db, const char *dir);
+int     db_follow_archive(db_obj *db, const char *dir);
+void    db_set_generation_counter(db_obj *db, volatile uint64 *counter);
+uint64  db_read_begin(db_obj *db);
+int     db_read_retry(db_obj *db, uint64 generation);
+int     db_contains(db_obj *db, const void *ptr); // Whether ptr lies inside the mapping of the file
+uint64  db_journal_size(db_obj *db);
+int     db_checkpoint(db_obj *db);
+void    db_compact_begin(db_obj *db, db_compaction *c);
+void    db_compact_object(db_compaction *c, void *ptr);
+void    db_compact_pointer(db_compaction *c, db_ptr *field);
+int     db_compact_finish(db_compaction *c);
 
 #endif // DB_H
@@ -0,0 +1,415 @@
+#include "db_btree.h"
+
+#include <string.h>
+#include <libowfat/byte.h>
+
+// Nodes with fewer entries are merged with or refilled from a neighbour
+#define MIN_ENTRIES (DB_BTREE_ORDER/4)
+
+static db_btree_node* new_node(db_btree *tree, int leaf);
+static int    compare(uint64 key_a, uint64 id_a, uint64 key_b, uint64 id_b);
+static uint32 lower_bound(db_btree_node *node, uint64 key, uint64 id);
+static uint32 child_index(db_btree_node *node, uint64 key, uint64 id);
+static db_btree_node* child(db_btree *tree, db_btree_node *node, uint32 index);
+static void   insert_entry(db_btree *tree, db_btree_node *node, uint32 index, db_btree_entry *entry);
+static void   remove_entry(db_btree *tree, db_btree_node *node, uint32 index);
+static db_btree_node* split(db_btree *tree, db_btree_node *node);
+static db_btree_node* insert_into(db_btree *tree, db_btree_node *node, db_btree_entry *entry, int *inserted);
+static int    remove_from(db_btree *tree, db_btree_node *node, uint64 key, uint64 id);
+static void   rebalance(db_btree *tree, db_btree_node *node, uint32 index);
+static int    load(db_btree_iter *it);
+
+void db_btree_init(db_btree *tree, db_obj *db, db_btree_data *data)
+{
+	tree->db = db;
+
+	if (!data) {
+		data = db_alloc(db, sizeof(db_btree_data));
+		byte_zero(data, sizeof(db_btree_data));
+		data->root = db_marshal(db, new_node(tree, 1));
+		db_invalidate_region(db, data, sizeof(db_btree_data));
+	}
+
+	tree->data = data;
+}
+
+db_ptr db_btree_marshal(db_btree *tree)
+{
+	return db_marshal(tree->db, tree->data);
+}
+
+void db_btree_insert(db_btree *tree, uint64 key, uint64 id, void *val)
+{
+	db_btree_entry entry;
+	entry.key = key;
+	entry.id  = id;
+	entry.ptr = db_marshal(tree->db, val);
+
+	int inserted = 0;
+	db_btree_node *root = db_unmarshal(tree->db, tree->data->root);
+	db_btree_node *sibling = insert_into(tree, root, &entry, &inserted);
+	if (sibling) {
+		// The tree grows at the top
+		db_btree_node *new_root = new_node(tree, 0);
+		new_root->entries[0].key = 0;
+		new_root->entries[0].id  = 0;
+		new_root->entries[0].ptr = db_marshal(tree->db, root);
+		new_root->entries[1].key = sibling->entries[0].key;
+		new_root->entries[1].id  = sibling->entries[0].id;
+		new_root->entries[1].ptr = db_marshal(tree->db, sibling);
+		new_root->count = 2;
+		db_invalidate_region(tree->db, new_root, sizeof(db_btree_node));
+		tree->data->root = db_marshal(tree->db, new_root);
+	}
+	if (inserted)
+		++tree->data->number_of_elements;
+	db_invalidate_region(tree->db, tree->data, sizeof(db_btree_data));
+}
+
+void db_btree_remove(db_btree *tree, uint64 key, uint64 id)
+{
+	db_btree_node *root = db_unmarshal(tree->db, tree->data->root);
+	if (!remove_from(tree, root, key, id))
+		return;
+
+	// The tree shrinks at the top
+	while (!root->leaf && root->count == 1) {
+		tree->data->root = root->entries[0].ptr;
+		db_free(tree->db, root);
+		root = db_unmarshal(tree->db, tree->data->root);
+	}
+	--tree->data->number_of_elements;
+	db_invalidate_region(tree->db, tree->data, sizeof(db_btree_data));
+}
+
+static void compact_node(db_btree *tree, db_compaction *c, db_btree_node *node)
+{
+	db_compact_object(c, node);
+	db_compact_pointer(c, &node->prev);
+	db_compact_pointer(c, &node->next);
+	for (uint32 i=0; i<node->count; ++i) {
+		if (!node->leaf)
+			compact_node(tree, c, child(tree, node, i));
+		db_compact_pointer(c, &node->entries[i].ptr);
+	}
+}
+
+void db_btree_compact(db_btree *tree, db_compaction *c)
+{
+	db_compact_object(c, tree->data);
+	compact_node(tree, c, db_unmarshal(tree->db, tree->data->root));
+	db_compact_pointer(c, &tree->data->root);
+}
+
+static void free_node(db_btree *tree, db_btree_node *node)
+{
+	if (!node->leaf) {
+		for (uint32 i=0; i<node->count; ++i)
+			free_node(tree, child(tree, node, i));
+	}
+	db_free(tree->db, node);
+}
+
+void db_btree_free(db_btree *tree)
+{
+	free_node(tree, db_unmarshal(tree->db, tree->data->root));
+	db_free(tree->db, tree->data);
+	tree->data = 0;
+}
+
+int db_btree_seek(db_btree *tree, db_btree_iter *it, uint64 key)
+{
+	db_btree_node *node = db_unmarshal(tree->db, tree->data->root);
+	while (!node->leaf)
+		node = child(tree, node, child_index(node, key, 0));
+
+	it->tree  = tree;
+	it->node  = node;
+	it->index = lower_bound(node, key, 0);
+	return load(it);
+}
+
+int db_btree_first(db_btree *tree, db_btree_iter *it)
+{
+	db_btree_node *node = db_unmarshal(tree->db, tree->data->root);
+	while (!node->leaf)
+		node = child(tree, node, 0);
+
+	it->tree  = tree;
+	it->node  = node;
+	it->index = 0;
+	return load(it);
+}
+
+int db_btree_last(db_btree *tree, db_btree_iter *it)
+{
+	db_btree_node *node = db_unmarshal(tree->db, tree->data->root);
+	while (!node->leaf)
+		node = child(tree, node, node->count-1);
+
+	it->tree = tree;
+	it->node = node;
+	if (!node->count) {
+		it->node = 0;
+		return 0;
+	}
+	it->index = node->count-1;
+	return load(it);
+}
+
+int db_btree_next(db_btree_iter *it)
+{
+	if (!it->node)
+		return 0;
+	++it->index;
+	return load(it);
+}
+
+int db_btree_prev(db_btree_iter *it)
+{
+	if (!it->node)
+		return 0;
+	// Only the root can be an empty leaf
+	while (it->index == 0) {
+		it->node = db_unmarshal(it->tree->db, it->node->prev);
+		if (!it->node)
+			return 0;
+		it->index = it->node->count;
+	}
+	--it->index;
+	return load(it);
+}
+
+// --- Internal ---
+
+static db_btree_node* new_node(db_btree *tree, int leaf)
+{
+	db_btree_node *node = db_alloc(tree->db, sizeof(db_btree_node));
+	byte_zero(node, sizeof(db_btree_node));
+	node->leaf = leaf;
+	db_invalidate_region(tree->db, node, sizeof(db_btree_node));
+	return node;
+}
+
+static int compare(uint64 key_a, uint64 id_a, uint64 key_b, uint64 id_b)
+{
+	if (key_a != key_b)
+		return (key_a < key_b)?-1:1;
+	if (id_a != id_b)
+		return (id_a < id_b)?-1:1;
+	return 0;
+}
+
+// Index of the first entry >= (key, id)
+static uint32 lower_bound(db_btree_node *node, uint64 key, uint64 id)
+{
+	uint32 lo = 0;
+	uint32 hi = node->count;
+	while (lo < hi) {
+		uint32 mid = (lo+hi)/2;
+		if (compare(node->entries[mid].key, node->entries[mid].id, key, id) < 0)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// Index of the subtree that (key, id) belongs to
+static uint32 child_index(db_btree_node *node, uint64 key, uint64 id)
+{
+	uint32 lo = 1;
+	uint32 hi = node->count;
+	while (lo < hi) {
+		uint32 mid = (lo+hi)/2;
+		if (compare(node->entries[mid].key, node->entries[mid].id, key, id) <= 0)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	return lo-1;
+}
+
+static db_btree_node* child(db_btree *tree, db_btree_node *node, uint32 index)
+{
+	return db_unmarshal(tree->db, node->entries[index].ptr);
+}
+
+static void insert_entry(db_btree *tree, db_btree_node *node, uint32 index, db_btree_entry *entry)
+{
+	memmove(&node->entries[index+1], &node->entries[index], sizeof(db_btree_entry)*(node->count-index));
+	node->entries[index] = *entry;
+	++node->count;
+	db_invalidate_region(tree->db, &node->count, sizeof(uint32));
+	db_invalidate_region(tree->db, &node->entries[index], sizeof(db_btree_entry)*(node->count-index));
+}
+
+static void remove_entry(db_btree *tree, db_btree_node *node, uint32 index)
+{
+	--node->count;
+	memmove(&node->entries[index], &node->entries[index+1], sizeof(db_btree_entry)*(node->count-index));
+	db_invalidate_region(tree->db, &node->count, sizeof(uint32));
+	if (index < node->count)
+		db_invalidate_region(tree->db, &node->entries[index], sizeof(db_btree_entry)*(node->count-index));
+}
+
+// Moves the upper half of the entries to a new node to the right
+static db_btree_node* split(db_btree *tree, db_btree_node *node)
+{
+	db_btree_node *sibling = new_node(tree, node->leaf);
+	uint32 half = node->count/2;
+	sibling->count = node->count - half;
+	memcpy(&sibling->entries[0], &node->entries[half], sizeof(db_btree_entry)*sibling->count);
+	node->count = half;
+
+	if (node->leaf) {
+		db_btree_node *next = db_unmarshal(tree->db, node->next);
+		sibling->prev = db_marshal(tree->db, node);
+		sibling->next = node->next;
+		node->next = db_marshal(tree->db, sibling);
+		if (next) {
+			next->prev = node->next;
+			db_invalidate_region(tree->db, &next->prev, sizeof(db_ptr));
+		}
+	}
+	db_invalidate_region(tree->db, node, sizeof(db_btree_node)-sizeof(node->entries));
+	db_invalidate_region(tree->db, sibling, sizeof(db_btree_node));
+	return sibling;
+}
+
+// Returns the new right neighbour if the node had to be split
+static db_btree_node* insert_into(db_btree *tree, db_btree_node *node, db_btree_entry *entry, int *inserted)
+{
+	db_btree_entry separator;
+	uint32 index;
+	if (node->leaf) {
+		index = lower_bound(node, entry->key, entry->id);
+		if (index < node->count && compare(node->entries[index].key, node->entries[index].id,
+		                                   entry->key, entry->id) == 0) {
+			// Already there, just update the object
+			node->entries[index].ptr = entry->ptr;
+			db_invalidate_region(tree->db, &node->entries[index].ptr, sizeof(db_ptr));
+			return 0;
+		}
+		*inserted = 1;
+	} else {
+		index = child_index(node, entry->key, entry->id);
+		db_btree_node *new_child = insert_into(tree, child(tree, node, index), entry, inserted);
+		if (!new_child)
+			return 0;
+
+		separator.key = new_child->entries[0].key;
+		separator.id  = new_child->entries[0].id;
+		separator.ptr = db_marshal(tree->db, new_child);
+		entry = &separator;
+		++index;
+	}
+
+	db_btree_node *sibling = 0;
+	if (node->count == DB_BTREE_ORDER) {
+		sibling = split(tree, node);
+		if (index > node->count) {
+			index -= node->count;
+			insert_entry(tree, sibling, index, entry);
+			return sibling;
+		}
+	}
+	insert_entry(tree, node, index, entry);
+	return sibling;
+}
+
+// Returns 1 if the entry was found
+static int remove_from(db_btree *tree, db_btree_node *node, uint64 key, uint64 id)
+{
+	if (node->leaf) {
+		uint32 index = lower_bound(node, key, id);
+		if (index == node->count || compare(node->entries[index].key, node->entries[index].id, key, id) != 0)
+			return 0;
+		remove_entry(tree, node, index);
+		return 1;
+	}
+
+	uint32 index = child_index(node, key, id);
+	db_btree_node *c = child(tree, node, index);
+	if (!remove_from(tree, c, key, id))
+		return 0;
+	if (c->count < MIN_ENTRIES)
+		rebalance(tree, node, index);
+	return 1;
+}
+
+// Merges the child at the given index with a neighbour, or moves entries over from it if both
+// don't fit into one node
+static void rebalance(db_btree *tree, db_btree_node *node, uint32 index)
+{
+	if (node->count < 2)
+		return;
+	if (index == node->count-1)
+		--index;
+	db_btree_node *left  = child(tree, node, index);
+	db_btree_node *right = child(tree, node, index+1);
+
+	if (!left->leaf) {
+		// The separator moves down, otherwise the first key of the right node would be lost
+		right->entries[0].key = node->entries[index+1].key;
+		right->entries[0].id  = node->entries[index+1].id;
+		db_invalidate_region(tree->db, &right->entries[0], sizeof(db_btree_entry));
+	}
+
+	if (left->count + right->count <= DB_BTREE_ORDER) {
+		if (right->count) {
+			memcpy(&left->entries[left->count], &right->entries[0], sizeof(db_btree_entry)*right->count);
+			db_invalidate_region(tree->db, &left->entries[left->count], sizeof(db_btree_entry)*right->count);
+			left->count += right->count;
+			db_invalidate_region(tree->db, &left->count, sizeof(uint32));
+		}
+		if (left->leaf) {
+			db_btree_node *next = db_unmarshal(tree->db, right->next);
+			left->next = right->next;
+			db_invalidate_region(tree->db, &left->next, sizeof(db_ptr));
+			if (next) {
+				next->prev = db_marshal(tree->db, left);
+				db_invalidate_region(tree->db, &next->prev, sizeof(db_ptr));
+			}
+		}
+		db_free(tree->db, right);
+		remove_entry(tree, node, index+1);
+		return;
+	}
+
+	uint32 total = left->count + right->count;
+	uint32 left_count = total/2;
+	if (left->count < left_count) {
+		uint32 n = left_count - left->count;
+		memcpy(&left->entries[left->count], &right->entries[0], sizeof(db_btree_entry)*n);
+		memmove(&right->entries[0], &right->entries[n], sizeof(db_btree_entry)*(right->count-n));
+	} else {
+		uint32 n = left->count - left_count;
+		memmove(&right->entries[n], &right->entries[0], sizeof(db_btree_entry)*right->count);
+		memcpy(&right->entries[0], &left->entries[left_count], sizeof(db_btree_entry)*n);
+	}
+	left->count  = left_count;
+	right->count = total - left_count;
+	db_invalidate_region(tree->db, left, sizeof(db_btree_node));
+	db_invalidate_region(tree->db, right, sizeof(db_btree_node));
+
+	node->entries[index+1].key = right->entries[0].key;
+	node->entries[index+1].id  = right->entries[0].id;
+	db_invalidate_region(tree->db, &node->entries[index+1], sizeof(db_btree_entry));
+}
+
+// Moves on to the next leaf if the iterator is past the end of its leaf
+static int load(db_btree_iter *it)
+{
+	while (it->index >= it->node->count) {
+		it->node = db_unmarshal(it->tree->db, it->node->next);
+		if (!it->node)
+			return 0;
+		it->index = 0;
+	}
+	db_btree_entry *entry = &it->node->entries[it->index];
+	it->key = entry->key;
+	it->id  = entry->id;
+	it->val = db_unmarshal(it->tree->db, entry->ptr);
+	return 1;
+}
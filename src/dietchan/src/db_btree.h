@@ -0,0 +1,62 @@
+#ifndef DB_BTREE_H
+#define DB_BTREE_H
+
+#include "db.h"
+
+// B+tree of (key, id) pairs, each of which refers to an object. Several objects can have the same
+// key, the id breaks the tie, so it has to be unique among them. Unlike a db_ptr, the id stays the
+// same when the database is compacted.
+
+#define DB_BTREE_ORDER 40 // Maximum number of entries of a node
+
+typedef struct db_btree_entry {
+	uint64 key;
+	uint64 id;
+	db_ptr ptr; // Leaf: the object. Internal node: the subtree with the entries >= (key, id).
+} db_btree_entry;
+
+// Internal nodes ignore the key of their first entry, its subtree contains everything below the
+// second entry.
+typedef struct db_btree_node {
+	uint32 leaf;
+	uint32 count;
+	db_ptr prev; // Neighbouring leaves
+	db_ptr next;
+	db_btree_entry entries[DB_BTREE_ORDER];
+} db_btree_node;
+
+typedef struct db_btree_data {
+	db_ptr root;
+	uint64 number_of_elements;
+} db_btree_data;
+
+typedef struct db_btree {
+	db_obj        *db;
+	db_btree_data *data;
+} db_btree;
+
+// Position in a tree, see db_btree_seek(). Invalidated by every change of the tree.
+typedef struct db_btree_iter {
+	db_btree      *tree;
+	db_btree_node *node;
+	uint32         index;
+	uint64         key;
+	uint64         id;
+	void          *val;
+} db_btree_iter;
+
+void    db_btree_init(db_btree *tree, db_obj *db, db_btree_data *data);
+db_ptr  db_btree_marshal(db_btree *tree);
+void    db_btree_insert(db_btree *tree, uint64 key, uint64 id, void *val);
+void    db_btree_remove(db_btree *tree, uint64 key, uint64 id);
+void    db_btree_compact(db_btree *tree, db_compaction *c);
+void    db_btree_free(db_btree *tree);
+
+// Return 1 and fill in key, id and val of the iterator if there is such an entry, 0 otherwise
+int     db_btree_seek(db_btree *tree, db_btree_iter *it, uint64 key); // First entry with a key >= key
+int     db_btree_first(db_btree *tree, db_btree_iter *it);
+int     db_btree_last(db_btree *tree, db_btree_iter *it);
+int     db_btree_next(db_btree_iter *it);
+int     db_btree_prev(db_btree_iter *it);
+
+#endif // DB_BTREE_H
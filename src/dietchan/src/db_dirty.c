@@ -0,0 +1,200 @@
+#include "db_dirty.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libowfat/byte.h>
+
+static uint32 page_hash(uint64 page, uint32 capacity)
+{
+	return (uint32)((page * 0x9e3779b97f4a7c15ULL) >> 32) & (capacity-1);
+}
+
+static db_dirty_page* get_page(db_dirty *dirty, int64 index)
+{
+	return array_get(&dirty->pages, sizeof(db_dirty_page), index);
+}
+
+void db_dirty_init(db_dirty *dirty)
+{
+	byte_zero(dirty, sizeof(db_dirty));
+	dirty->last = -1;
+}
+
+static void grow_slots(db_dirty *dirty)
+{
+	uint32 capacity = dirty->capacity?(2*dirty->capacity):64;
+	uint32 *slots = calloc(capacity, sizeof(uint32));
+	assert(slots);
+
+	size_t count = array_length(&dirty->pages, sizeof(db_dirty_page));
+	for (size_t i=0; i<count; ++i) {
+		db_dirty_page *p = get_page(dirty, i);
+		uint32 slot = page_hash(p->page, capacity);
+		while (slots[slot])
+			slot = (slot+1) & (capacity-1);
+		slots[slot] = i+1;
+		p->slot = slot;
+	}
+
+	free(dirty->slots);
+	dirty->slots = slots;
+	dirty->capacity = capacity;
+}
+
+static db_dirty_page* find_or_add_page(db_dirty *dirty, uint64 page)
+{
+	if (dirty->last >= 0) {
+		db_dirty_page *p = get_page(dirty, dirty->last);
+		if (p->page == page)
+			return p;
+	}
+
+	size_t count = array_length(&dirty->pages, sizeof(db_dirty_page));
+	if (2*(count+1) > dirty->capacity)
+		grow_slots(dirty);
+
+	uint32 slot = page_hash(page, dirty->capacity);
+	while (dirty->slots[slot]) {
+		db_dirty_page *p = get_page(dirty, dirty->slots[slot]-1);
+		if (p->page == page) {
+			dirty->last = dirty->slots[slot]-1;
+			return p;
+		}
+		slot = (slot+1) & (dirty->capacity-1);
+	}
+
+	db_dirty_page *p = array_allocate(&dirty->pages, sizeof(db_dirty_page), count);
+	assert(p);
+	p->page  = page;
+	p->slot  = slot;
+	p->count = 0;
+	dirty->slots[slot] = count+1;
+	dirty->last = count;
+	return p;
+}
+
+// Adds [s, e) to the intervals of the page, merging it with the intervals it overlaps or touches
+static void page_insert(db_dirty_page *p, uint16 s, uint16 e)
+{
+	int i=0;
+	while (i<p->count && p->end[i] < s)
+		++i;
+
+	int j=i;
+	while (j<p->count && p->start[j] <= e) {
+		if (p->start[j] < s)
+			s = p->start[j];
+		if (p->end[j] > e)
+			e = p->end[j];
+		++j;
+	}
+
+	// Replace intervals i..j-1 with [s, e)
+	int removed = j-i;
+	if (removed != 1) {
+		memmove(&p->start[i+1], &p->start[j], (p->count-j)*sizeof(uint16));
+		memmove(&p->end[i+1],   &p->end[j],   (p->count-j)*sizeof(uint16));
+		p->count = p->count + 1 - removed;
+	}
+	p->start[i] = s;
+	p->end[i]   = e;
+
+	if (p->count > DB_DIRTY_MAX_INTERVALS) {
+		// Join the two intervals with the smallest gap between them
+		int k=0;
+		for (int l=1; l<p->count-1; ++l) {
+			if (p->start[l+1] - p->end[l] < p->start[k+1] - p->end[k])
+				k = l;
+		}
+		p->end[k] = p->end[k+1];
+		memmove(&p->start[k+1], &p->start[k+2], (p->count-k-2)*sizeof(uint16));
+		memmove(&p->end[k+1],   &p->end[k+2],   (p->count-k-2)*sizeof(uint16));
+		--p->count;
+	}
+}
+
+void db_dirty_insert(db_dirty *dirty, int64 start, uint64 size)
+{
+	int64 end = start + size;
+	while (start < end) {
+		uint64 page = start / DB_DIRTY_PAGE_SIZE;
+		int64 page_start = page * DB_DIRTY_PAGE_SIZE;
+		int64 page_end = page_start + DB_DIRTY_PAGE_SIZE;
+		if (page_end > end)
+			page_end = end;
+
+		db_dirty_page *p = find_or_add_page(dirty, page);
+		page_insert(p, start - page_start, page_end - page_start);
+
+		start = page_end;
+	}
+}
+
+int db_dirty_empty(db_dirty *dirty)
+{
+	return array_length(&dirty->pages, sizeof(db_dirty_page)) == 0;
+}
+
+size_t db_dirty_page_count(db_dirty *dirty)
+{
+	return array_length(&dirty->pages, sizeof(db_dirty_page));
+}
+
+static int page_comp(const void *_a, const void *_b)
+{
+	const db_dirty_page *a = _a;
+	const db_dirty_page *b = _b;
+	if (a->page < b->page)
+		return -1;
+	if (a->page > b->page)
+		return +1;
+	return 0;
+}
+
+// Appends all dirty ranges to regions (db_region) in ascending order. Ranges that continue
+// across a page boundary are returned as one region.
+// Only the dirty pages are sorted, so the cost does not depend on the number of inserts.
+void db_dirty_regions(db_dirty *dirty, array *regions)
+{
+	size_t count = array_length(&dirty->pages, sizeof(db_dirty_page));
+	if (count == 0)
+		return;
+
+	qsort(array_start(&dirty->pages), count, sizeof(db_dirty_page), page_comp);
+
+	// The pages moved, update the table
+	for (size_t i=0; i<count; ++i) {
+		db_dirty_page *p = get_page(dirty, i);
+		dirty->slots[p->slot] = i+1;
+	}
+	dirty->last = -1;
+
+	db_region *current = 0;
+	for (size_t i=0; i<count; ++i) {
+		db_dirty_page *p = get_page(dirty, i);
+		int64 page_start = p->page * DB_DIRTY_PAGE_SIZE;
+		for (int k=0; k<p->count; ++k) {
+			int64 start = page_start + p->start[k];
+			int64 end   = page_start + p->end[k];
+			if (current && current->end == start) {
+				current->end = end;
+				continue;
+			}
+			size_t n = array_length(regions, sizeof(db_region));
+			current = array_allocate(regions, sizeof(db_region), n);
+			assert(current);
+			current->start = start;
+			current->end   = end;
+		}
+	}
+}
+
+void db_dirty_clear(db_dirty *dirty)
+{
+	size_t count = array_length(&dirty->pages, sizeof(db_dirty_page));
+	for (size_t i=0; i<count; ++i)
+		dirty->slots[get_page(dirty, i)->slot] = 0;
+	array_trunc(&dirty->pages);
+	dirty->last = -1;
+}
@@ -0,0 +1,44 @@
+#ifndef DB_DIRTY_H
+#define DB_DIRTY_H
+
+#include <libowfat/array.h>
+#include <libowfat/uint16.h>
+#include <libowfat/uint32.h>
+#include <libowfat/uint64.h>
+
+// Set of dirty byte ranges of the database file, positions are offsets into the file.
+// Ranges are merged as they are inserted: the file is divided into pages and each dirty page
+// keeps a short sorted list of disjoint intervals. If a page collects too many intervals, the two
+// closest ones are joined, so a few clean bytes may be reported as dirty.
+
+#define DB_DIRTY_PAGE_SIZE     4096
+#define DB_DIRTY_MAX_INTERVALS 8
+
+typedef struct db_region {
+	int64 start;
+	int64 end;
+} db_region;
+
+typedef struct db_dirty_page {
+	uint64 page;
+	uint32 slot;
+	uint16 count;
+	uint16 start[DB_DIRTY_MAX_INTERVALS+1];
+	uint16 end[DB_DIRTY_MAX_INTERVALS+1];
+} db_dirty_page;
+
+typedef struct db_dirty {
+	array   pages;    // db_dirty_page
+	uint32 *slots;    // Open addressing table: page number -> index into pages + 1, 0 if empty
+	uint32  capacity; // Number of slots, a power of two
+	int64   last;     // Index of the most recently used page, -1 if none
+} db_dirty;
+
+void   db_dirty_init(db_dirty *dirty);
+void   db_dirty_insert(db_dirty *dirty, int64 start, uint64 size);
+int    db_dirty_empty(db_dirty *dirty);
+size_t db_dirty_page_count(db_dirty *dirty);
+void   db_dirty_regions(db_dirty *dirty, array *regions);
+void   db_dirty_clear(db_dirty *dirty);
+
+#endif // DB_DIRTY_H
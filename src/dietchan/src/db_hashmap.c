@@ -3,18 +3,24 @@
 #include <assert.h>
 #include <libowfat/byte.h>
 
-#define RELOCATED (~0UL)
+// Marks a slot of the previous array whose entry has been removed. Unlike an empty slot, lookups
+// have to probe past it.
+#define TOMBSTONE (~0UL)
+
+#define INITIAL_CAPACITY 64
+// Number of slots cleared or moved by every insert and remove while the table is resized. The
+// table grows at half load and shrinks to half its size at one eighth load, clearing has to be
+// done before the table gets too full.
+#define CLEAR_STEP   16
+#define MIGRATE_STEP 16
 
 static uint64 db_hashmap_hash(db_hashmap *map, void *key);
 static int    db_hashmap_eq(db_hashmap *map, void *key_a, void *key_b);
-static uint64 murmur(uint64 val);
-static uint64 shrink_hash(uint64 hash, uint64 modulus);
-static void   insert_element_internal(db_hashmap *map, db_ptr *buckets, uint64 index, void *key, void *val);
-static void*  get_element_internal(db_hashmap *map, db_ptr *buckets, uint64 index, void *key);
-static void   remove_element_internal(db_hashmap *map, db_ptr *buckets, uint64 index, void *key);
-static void   rehash_bucket(db_hashmap *map, uint64 hash);
-static void   rehash_some(db_hashmap *map);
-static void   maybe_grow(db_hashmap *map);
+static db_hashmap_slot* find_slot(db_hashmap *map, db_hashmap_slot *slots, uint64 capacity, uint64 skip_below, uint64 hash, void *key);
+static void   insert_slot(db_hashmap *map, db_hashmap_slot *slots, uint64 capacity, uint64 hash, db_ptr key, db_ptr val);
+static void   remove_slot(db_hashmap *map, db_hashmap_slot *slots, uint64 capacity, uint64 index);
+static void   resize_some(db_hashmap *map);
+static void   maybe_resize(db_hashmap *map);
 
 void  db_hashmap_init(db_hashmap *map, db_obj *db, db_hashmap_data *data,
                       db_hash_func hash_func, void *hash_func_extra,
@@ -25,13 +31,12 @@ void  db_hashmap_init(db_hashmap *map, db_obj *db, db_hashmap_data *data,
 	if (!data) {
 		data = db_alloc(db, sizeof(db_hashmap_data));
 		byte_zero(data, sizeof(db_hashmap_data));
-		db_invalidate_region(db, data, sizeof(db_hashmap_data));
 
-		data->buckets_new_capacity = 64; // must be a power of two
-		uint64 *new_buckets = db_alloc(db, sizeof(uint64)*data->buckets_new_capacity);
-		data->buckets_new = db_marshal(db, new_buckets);
-		byte_zero(new_buckets, sizeof(db_ptr)*data->buckets_new_capacity);
-		db_invalidate_region(db, new_buckets, sizeof(db_ptr)*data->buckets_new_capacity);
+		data->capacity = INITIAL_CAPACITY;
+		db_hashmap_slot *slots = db_alloc(db, sizeof(db_hashmap_slot)*data->capacity);
+		byte_zero(slots, sizeof(db_hashmap_slot)*data->capacity);
+		db_invalidate_region(db, slots, sizeof(db_hashmap_slot)*data->capacity);
+		data->slots = db_marshal(db, slots);
 
 		db_invalidate_region(db, data, sizeof(db_hashmap_data));
 	}
@@ -51,72 +56,193 @@ db_ptr db_hashmap_marshal(db_hashmap *map)
 
 void   db_hashmap_insert(db_hashmap *map, void *key, void *val)
 {
-	int64 hash = db_hashmap_hash(map, key);
-	rehash_some(map);
-
-	int inserted = 0;
-
-	if (map->data->buckets_old_capacity > 0) {
-		uint64 old_index = shrink_hash(hash, map->data->buckets_old_capacity);
-		if (old_index >= map->data->buckets_old_progress) {
-			// Insert into old table
-			insert_element_internal(map, db_unmarshal(map->db, map->data->buckets_old), old_index, key, val);
-			inserted = 1;
-		} /*else {
-			// Mark in old table that we have data in the new table
-			uint64 old_index = shrink_hash(hash, map->data->buckets_old_capacity);
-			db_ptr *buckets_old = db_unmarshal(map->db, map->data->buckets_old);
-			buckets_old[old_index] = RELOCATED;
-
-		}*/
-	}
+	uint64 hash = db_hash_mix(db_hashmap_hash(map, key));
+	resize_some(map);
 
-	if (!inserted) {
-		// Otherwise insert into new table
-		uint64 new_index = shrink_hash(hash, map->data->buckets_new_capacity);
-		insert_element_internal(map, db_unmarshal(map->db, map->data->buckets_new), new_index, key, val);
-	}
+	// New entries always go to the current array
+	insert_slot(map, db_unmarshal(map->db, map->data->slots), map->data->capacity, hash,
+	            db_marshal(map->db, key), db_marshal(map->db, val));
 
 	++(map->data->number_of_elements);
 	db_invalidate_region(map->db, &map->data->number_of_elements, sizeof(uint64));
-	maybe_grow(map);
+	maybe_resize(map);
 }
 
 void* db_hashmap_get(db_hashmap  *map, void *key)
 {
-	uint64 hash = db_hashmap_hash(map, key);
+	uint64 hash = db_hash_mix(db_hashmap_hash(map, key));
+
+	db_hashmap_slot *slot = find_slot(map, db_unmarshal(map->db, map->data->slots),
+	                                  map->data->capacity, 0, hash, key);
+	if (!slot && map->data->slots_old) {
+		// Not moved yet
+		slot = find_slot(map, db_unmarshal(map->db, map->data->slots_old),
+		                 map->data->slots_old_capacity, map->data->slots_old_progress, hash, key);
+	}
+	return slot?db_unmarshal(map->db, slot->val):0;
+}
+
+void   db_hashmap_remove(db_hashmap *map, void *key)
+{
+	uint64 hash = db_hash_mix(db_hashmap_hash(map, key));
+	resize_some(map);
+
+	db_hashmap_slot *slots = db_unmarshal(map->db, map->data->slots);
+	db_hashmap_slot *slot = find_slot(map, slots, map->data->capacity, 0, hash, key);
+	if (slot) {
+		remove_slot(map, slots, map->data->capacity, slot - slots);
+	} else if (map->data->slots_old) {
+		// Entries are never shifted in the previous array, that would move them past the progress
+		// index
+		slot = find_slot(map, db_unmarshal(map->db, map->data->slots_old),
+		                 map->data->slots_old_capacity, map->data->slots_old_progress, hash, key);
+		if (!slot)
+			return;
+		slot->key  = 0;
+		slot->hash = TOMBSTONE;
+		db_invalidate_region(map->db, slot, sizeof(db_hashmap_slot));
+	} else {
+		return;
+	}
+
+	--(map->data->number_of_elements);
+	db_invalidate_region(map->db, &map->data->number_of_elements, sizeof(uint64));
+	maybe_resize(map);
+}
+
+void db_hashmap_reserve(db_hashmap *map, uint64 count)
+{
+	db_hashmap_data *data = map->data;
 
-	if (map->data->buckets_old_capacity > 0) {
-		uint64 old_index = shrink_hash(hash, map->data->buckets_old_capacity);
+	while (data->next_slots || data->slots_old)
+		resize_some(map);
 
-		if (old_index >= map->data->buckets_old_progress) {
-			// Search in old table
-			return get_element_internal(map, db_unmarshal(map->db, map->data->buckets_old), old_index, key);
-		}
+	uint64 capacity = data->capacity;
+	while (capacity/2 < count)
+		capacity *= 2;
+	if (capacity == data->capacity)
+		return;
+
+	db_hashmap_slot *slots = db_alloc(map->db, sizeof(db_hashmap_slot)*capacity);
+	byte_zero(slots, sizeof(db_hashmap_slot)*capacity);
+	db_hashmap_slot *slots_old = db_unmarshal(map->db, data->slots);
+	for (uint64 i=0; i<data->capacity; ++i) {
+		if (slots_old[i].key)
+			insert_slot(map, slots, capacity, slots_old[i].hash, slots_old[i].key, slots_old[i].val);
 	}
+	db_invalidate_region(map->db, slots, sizeof(db_hashmap_slot)*capacity);
+	db_free(map->db, slots_old);
 
-	// Search in new table
-	uint64 new_index = shrink_hash(hash, map->data->buckets_new_capacity);
-	return get_element_internal(map, db_unmarshal(map->db, map->data->buckets_new), new_index, key);
+	data->slots    = db_marshal(map->db, slots);
+	data->capacity = capacity;
+	db_invalidate_region(map->db, data, sizeof(db_hashmap_data));
 }
 
-void   db_hashmap_remove(db_hashmap *map, void *key)
+void db_hashmap_compact(db_hashmap *map, db_compaction *c)
 {
-	int64 hash = db_hashmap_hash(map, key);
-	rehash_some(map);
-
-	if (map->data->buckets_old_capacity > 0) {
-		uint64 old_index = shrink_hash(hash, map->data->buckets_old_capacity);
-		if (old_index >= map->data->buckets_old_progress) {
-			// Remove from old table
-			remove_element_internal(map, db_unmarshal(map->db, map->data->buckets_old), old_index, key);
-			return;
-		}
+	// Finish a pending resize first, then only the current array is in use
+	while (map->data->next_slots || map->data->slots_old)
+		resize_some(map);
+
+	db_compact_object(c, map->data);
+	db_compact_pointer(c, &map->data->slots);
+	db_compact_pointer(c, &map->data->next_slots);
+	db_compact_pointer(c, &map->data->slots_old);
+
+	db_hashmap_slot *slots = db_unmarshal(map->db, map->data->slots);
+	db_compact_object(c, slots);
+	for (uint64 i=0; i<map->data->capacity; ++i) {
+		if (!slots[i].key)
+			continue;
+		db_compact_pointer(c, &slots[i].key);
+		db_compact_pointer(c, &slots[i].val);
+	}
+}
+
+void db_hashmap_free(db_hashmap *map)
+{
+	db_free(map->db, db_unmarshal(map->db, map->data->slots));
+	if (map->data->next_slots)
+		db_free(map->db, db_unmarshal(map->db, map->data->next_slots));
+	if (map->data->slots_old)
+		db_free(map->db, db_unmarshal(map->db, map->data->slots_old));
+	db_free(map->db, map->data);
+	map->data = 0;
+}
+
+// Layout of the tables written by older versions: an array of buckets, each of which is a
+// separately allocated array of the form (count, key 1, value 1, key 2, value 2, ...).
+typedef struct legacy_hashmap_data {
+	db_ptr buckets_old;
+	uint64 buckets_old_capacity;
+	uint64 buckets_old_progress;
+	db_ptr buckets_new;
+	uint64 buckets_new_capacity;
+	uint64 number_of_elements;
+} legacy_hashmap_data;
+
+#define LEGACY_RELOCATED (~0UL)
+
+static void upgrade_bucket(db_hashmap *map, db_hashmap_data *data, db_ptr ptr)
+{
+	if (ptr == LEGACY_RELOCATED)
+		return;
+	uint64 *bucket = db_unmarshal(map->db, ptr);
+	if (!bucket)
+		return;
+	db_hashmap_slot *slots = db_unmarshal(map->db, data->slots);
+	for (uint64 i=0; i<bucket[0]; ++i) {
+		void *key = db_unmarshal(map->db, bucket[2*i+1]);
+		insert_slot(map, slots, data->capacity, db_hash_mix(db_hashmap_hash(map, key)), bucket[2*i+1], bucket[2*i+2]);
+		++data->number_of_elements;
 	}
+	db_free(map->db, bucket);
+}
 
-	// Remove from new table
-	uint64 new_index = shrink_hash(hash, map->data->buckets_new_capacity);
-	remove_element_internal(map, db_unmarshal(map->db, map->data->buckets_new), new_index, key);
+void db_hashmap_upgrade(db_hashmap *map)
+{
+	legacy_hashmap_data *legacy = (legacy_hashmap_data*)map->data;
+
+	db_hashmap_data *data = db_alloc(map->db, sizeof(db_hashmap_data));
+	byte_zero(data, sizeof(db_hashmap_data));
+	data->capacity = INITIAL_CAPACITY;
+	while (data->capacity/2 < legacy->number_of_elements)
+		data->capacity *= 2;
+	db_hashmap_slot *slots = db_alloc(map->db, sizeof(db_hashmap_slot)*data->capacity);
+	byte_zero(slots, sizeof(db_hashmap_slot)*data->capacity);
+	db_invalidate_region(map->db, slots, sizeof(db_hashmap_slot)*data->capacity);
+	data->slots = db_marshal(map->db, slots);
+
+	// A resize may have been in progress. Buckets of the old array below the progress index have
+	// been moved, and only the buckets of the new array that they were moved to are initialized.
+	db_ptr *buckets_old = db_unmarshal(map->db, legacy->buckets_old);
+	db_ptr *buckets_new = db_unmarshal(map->db, legacy->buckets_new);
+	if (buckets_old) {
+		for (uint64 i=legacy->buckets_old_progress; i<legacy->buckets_old_capacity; ++i)
+			upgrade_bucket(map, data, buckets_old[i]);
+	}
+	for (uint64 i=0; i<legacy->buckets_new_capacity; ++i) {
+		if (buckets_old && (i & (legacy->buckets_old_capacity-1)) >= legacy->buckets_old_progress)
+			continue;
+		upgrade_bucket(map, data, buckets_new[i]);
+	}
+
+	if (buckets_old)
+		db_free(map->db, buckets_old);
+	db_free(map->db, buckets_new);
+	db_free(map->db, legacy);
+
+	db_invalidate_region(map->db, data, sizeof(db_hashmap_data));
+	map->data = data;
+}
+
+void db_hashmap_upgrade_data(db_hashmap *map)
+{
+	// Tables written before next_capacity was added could only grow
+	db_hashmap_data *data = db_realloc(map->db, map->data, sizeof(db_hashmap_data));
+	data->next_capacity = data->next_slots?2*data->capacity:0;
+	db_invalidate_region(map->db, data, sizeof(db_hashmap_data));
+	map->data = data;
 }
 
 uint64 uint64_hash(void *value, void *extra)
@@ -147,228 +273,172 @@ static int db_hashmap_eq(db_hashmap *map, void *key_a, void *key_b)
 		return key_a == key_b;
 }
 
-uint64 murmur(uint64 val)
-{
-	const uint64 m=0x5bd1e995;
-	val ^= val >> 24;
-	val *= m;
-	val ^= val >> 13;
-	val *= m;
-	val ^= val >> 15;
-	return val;
-}
-
-static uint64 shrink_hash(uint64 hash, uint64 modulus)
+// Distance of the entry in the given slot from the slot it hashes to
+static uint64 probe_distance(db_hashmap_slot *slot, uint64 index, uint64 capacity)
 {
-	// modulus must be a power of two
-	assert (!(((int64)modulus - 1) & (int64)modulus));
-
-	// Make bad hash functions more random
-	hash = murmur(hash);
-
-	// Mix some higher-order into lower-order bits.
-	// Experience has shown that this works better.
-	return (hash ^ (hash >>  8) ^ (hash >> 16) ^ (hash >> 24)
-	             ^ (hash >> 32) ^ (hash >> 40) ^ (hash >> 48)
-	             ^ (hash >> 56)) % modulus;
+	return (index - (slot->hash & (capacity-1))) & (capacity-1);
 }
 
-static void insert_element_internal(db_hashmap *map, db_ptr *buckets, uint64 index, void *key, void *val)
+// Slots below skip_below are treated as removed, they belong to entries that have been moved to
+// the current array.
+static db_hashmap_slot* find_slot(db_hashmap *map, db_hashmap_slot *slots, uint64 capacity, uint64 skip_below, uint64 hash, void *key)
 {
-	assert(buckets);
-	uint64 *bucket = db_unmarshal(map->db, buckets[index]);
-
-	assert(bucket != db_unmarshal(map->db, map->data->buckets_new));
-	assert(!bucket || bucket != db_unmarshal(map->db, map->data->buckets_old));
-
-	if (!bucket) {
-		// Allocate new bucket
-		bucket = db_alloc(map->db, sizeof(uint64)*3); // 3 = count + key + value
-		bucket[0] = 1;
-		bucket[1] = db_marshal(map->db, key);
-		bucket[2] = db_marshal(map->db, val);
-		db_invalidate_region(map->db, bucket, sizeof(uint64)*3);
-	} else {
-		#if 1
-		for (int i=0; i<bucket[0]; ++i) {
-			assert(!db_hashmap_eq(map, key, db_unmarshal(map->db, bucket[2*i+1])));
+	if (!slots)
+		return 0;
+	uint64 index = hash & (capacity-1);
+	uint64 distance = 0;
+	while (distance < capacity) {
+		if (index < skip_below) {
+			// Jump over the moved slots instead of walking through them
+			if (skip_below >= capacity)
+				return 0;
+			distance += skip_below - index;
+			index = skip_below;
+			continue;
 		}
-		#endif
-		// Append to existing bucket
-		uint64 new_size = bucket[0] + 1;
-		bucket = db_realloc(map->db, bucket, sizeof(uint64)*(new_size*2 + 1));
-		bucket[0] = new_size;
-		bucket[2*new_size-1] = db_marshal(map->db, key);
-		bucket[2*new_size]   = db_marshal(map->db, val);
-		db_invalidate_region(map->db, &bucket[0], sizeof(uint64));
-		db_invalidate_region(map->db, &bucket[2*new_size-1], 2*sizeof(uint64));
-	}
-
-	buckets[index] = db_marshal(map->db, bucket);
-	db_invalidate_region(map->db, &buckets[index], sizeof(db_ptr));
-}
-
-static void* get_element_internal(db_hashmap *map, db_ptr *buckets, uint64 index, void *key)
-{
-	if (!buckets)
-		goto not_found;
-	assert (buckets[index] != RELOCATED);
-	if (buckets[index] == RELOCATED)
-		goto not_found;
-	uint64 *bucket = db_unmarshal(map->db, buckets[index]);
-	if (!bucket)
-		goto not_found;
-	uint64 bucket_size = bucket[0];
-	for (int64 i=0; i<bucket_size; ++i) {
-		void *k = db_unmarshal(map->db, bucket[2*i+1]);
-		void *v = db_unmarshal(map->db, bucket[2*i+2]);
-		if (db_hashmap_eq(map, key, k))
-			return v;
+		db_hashmap_slot *slot = &slots[index];
+		if (!slot->key) {
+			if (slot->hash != TOMBSTONE)
+				return 0;
+		} else {
+			// Robin Hood invariant: had the key been inserted, it would have taken this slot
+			if (probe_distance(slot, index, capacity) < distance)
+				return 0;
+			if (slot->hash == hash && db_hashmap_eq(map, key, db_unmarshal(map->db, slot->key)))
+				return slot;
+		}
+		index = (index+1) & (capacity-1);
+		++distance;
 	}
-not_found:
 	return 0;
 }
 
-static void remove_element_internal(db_hashmap *map, db_ptr *buckets, uint64 index, void *key)
+static void insert_slot(db_hashmap *map, db_hashmap_slot *slots, uint64 capacity, uint64 hash, db_ptr key, db_ptr val)
 {
-	assert(buckets);
-
-	uint64 *bucket = db_unmarshal(map->db, buckets[index]);
-	if (!bucket)
-		return;
-
-	uint64 bucket_size = bucket[0];
-	for (int64 i=0; i<bucket_size; ++i) {
-		void *k = db_unmarshal(map->db, bucket[2*i+1]);
-		if (db_hashmap_eq(map, key, k)) {
-			bucket[2*i+1] = bucket[2*bucket_size-1];
-			bucket[2*i+2] = bucket[2*bucket_size];
-			db_invalidate_region(map->db, &bucket[2*i+1], sizeof(uint64)*2);
-			--bucket_size;
-			if (bucket_size == 0) {
-				db_free(map->db, bucket);
-				bucket = 0;
-			} else {
-				bucket = db_realloc(map->db, bucket, sizeof(uint64)*(2*bucket_size + 1));
-				bucket[0] = bucket_size;
-				db_invalidate_region(map->db, &bucket[0], sizeof(uint64));
-			}
-			buckets[index] = db_marshal(map->db, bucket);
-			db_invalidate_region(map->db, &buckets[index], sizeof(db_ptr));
-
-			--(map->data->number_of_elements);
-			db_invalidate_region(map->db, &map->data->number_of_elements, sizeof(uint64));
-
+	db_hashmap_slot entry;
+	entry.hash = hash;
+	entry.key  = key;
+	entry.val  = val;
+
+	uint64 index = hash & (capacity-1);
+	uint64 distance = 0;
+	while (1) {
+		db_hashmap_slot *slot = &slots[index];
+		if (!slot->key) {
+			*slot = entry;
+			db_invalidate_region(map->db, slot, sizeof(db_hashmap_slot));
 			return;
 		}
+		// Take the slot from entries that are closer to their home, continue with the displaced
+		// entry
+		uint64 slot_distance = probe_distance(slot, index, capacity);
+		if (slot_distance < distance) {
+			db_hashmap_slot displaced = *slot;
+			*slot = entry;
+			db_invalidate_region(map->db, slot, sizeof(db_hashmap_slot));
+			entry = displaced;
+			distance = slot_distance;
+		}
+		index = (index+1) & (capacity-1);
+		++distance;
 	}
-
 }
 
-static void rehash_bucket(db_hashmap *map, uint64 old_index)
+// Backward shift deletion: the following entries move one slot closer to their home, so no
+// tombstones are needed in the current array
+static void remove_slot(db_hashmap *map, db_hashmap_slot *slots, uint64 capacity, uint64 index)
 {
-	// Remove bucket from old hashmap and move to new hashmap
-
-	db_ptr *old_buckets = db_unmarshal(map->db, map->data->buckets_old);
-	if (!old_buckets)
-		return;
-
-	// If we already rehashed the bucket, nothing to do here
-	if (old_buckets[old_index] == RELOCATED)
-		return;
-
-	// The old bucket can map to two possible new buckets.
-	// These are not initialized yet. Initialize them.
-	uint64 new_index0 = old_index;
-	uint64 new_index1 = old_index + map->data->buckets_new_capacity / 2;
-	db_ptr *new_buckets = db_unmarshal(map->db, map->data->buckets_new);
-	new_buckets[new_index0] = 0;
-	new_buckets[new_index1] = 0;
-
-	// Mark old bucket as relocated.
-	uint64 *old_bucket = db_unmarshal(map->db, old_buckets[old_index]);
-	old_buckets[old_index] = RELOCATED;
-
-	db_invalidate_region(map->db, &new_buckets[new_index0], sizeof(db_ptr));
-	db_invalidate_region(map->db, &new_buckets[new_index1], sizeof(db_ptr));
-	db_invalidate_region(map->db, &old_buckets[old_index],  sizeof(db_ptr));
-
-	// If old_bucket is null, it means it's empty, nothing to do.
-	if (!old_bucket)
-		return;
-
-	// First element is the number of elements in the bucket.
-	// Further elements are pairs of (key, value).
-	uint64 old_bucket_size = old_bucket[0];
-
-	// Insert all elements of this bucket into new hash table
-	for (int64 i=0; i<old_bucket_size; ++i) {
-		void *key = db_unmarshal(map->db, old_bucket[2*i+1]);
-		void *val = db_unmarshal(map->db, old_bucket[2*i+2]);
-		uint64 hash = db_hashmap_hash(map, key);
-		uint64 index = shrink_hash(hash, map->data->buckets_new_capacity);
-		insert_element_internal(map, new_buckets, index, key, val);
+	while (1) {
+		uint64 next = (index+1) & (capacity-1);
+		if (!slots[next].key || probe_distance(&slots[next], next, capacity) == 0)
+			break;
+		slots[index] = slots[next];
+		db_invalidate_region(map->db, &slots[index], sizeof(db_hashmap_slot));
+		index = next;
 	}
-
-	// Free old bucket
-	db_free(map->db, old_bucket);
+	byte_zero(&slots[index], sizeof(db_hashmap_slot));
+	db_invalidate_region(map->db, &slots[index], sizeof(db_hashmap_slot));
 }
 
-static void rehash_some(db_hashmap *map)
+// Clears some slots of the next array or moves some entries out of the previous array
+static void resize_some(db_hashmap *map)
 {
-	if (!map->data->buckets_old)
+	db_hashmap_data *data = map->data;
+
+	if (data->next_slots) {
+		uint64 next_capacity = data->next_capacity;
+		uint64 count = next_capacity - data->next_cleared;
+		if (count > CLEAR_STEP)
+			count = CLEAR_STEP;
+		db_hashmap_slot *next_slots = db_unmarshal(map->db, data->next_slots);
+		byte_zero(&next_slots[data->next_cleared], sizeof(db_hashmap_slot)*count);
+		db_invalidate_region(map->db, &next_slots[data->next_cleared], sizeof(db_hashmap_slot)*count);
+		data->next_cleared += count;
+
+		if (data->next_cleared == next_capacity) {
+			// Switch to the next array, the entries are moved from now on
+			data->slots_old          = data->slots;
+			data->slots_old_capacity = data->capacity;
+			data->slots_old_progress = 0;
+			data->slots              = data->next_slots;
+			data->capacity           = next_capacity;
+			data->next_slots         = 0;
+			data->next_cleared       = 0;
+			data->next_capacity      = 0;
+		}
+		db_invalidate_region(map->db, data, sizeof(db_hashmap_data));
 		return;
-	// Rehash 8 buckets in every step.
-	// The number could be tweaked, but it must be strictly greater than 1, I think.
-	// Better have some safety margin just to be sure. Everything 4 and above should be fine.
-	for (uint64 i=0; i<8 && map->data->buckets_old_progress<map->data->buckets_old_capacity; ++i) {
-		rehash_bucket(map, map->data->buckets_old_progress);
-		++map->data->buckets_old_progress;
 	}
 
-	if (map->data->buckets_old_progress >= map->data->buckets_old_capacity) {
-		// Success, we have rehashed everything!
-		// Now we can free the old hashtable.
-		db_ptr *old_buckets = db_unmarshal(map->db, map->data->buckets_old);
-		db_free(map->db, old_buckets);
-		map->data->buckets_old = db_marshal(map->db, 0);
-		map->data->buckets_old_capacity = 0;
-		map->data->buckets_old_progress = 0;
-		db_invalidate_region(map->db, &map->data->buckets_old, sizeof(db_ptr));
-		db_invalidate_region(map->db, &map->data->buckets_old_capacity, sizeof(uint64));
+	if (!data->slots_old)
+		return;
+
+	db_hashmap_slot *slots     = db_unmarshal(map->db, data->slots);
+	db_hashmap_slot *slots_old = db_unmarshal(map->db, data->slots_old);
+	// The moved entries stay where they are, lookups skip everything below the progress index
+	for (uint64 i=0; i<MIGRATE_STEP && data->slots_old_progress<data->slots_old_capacity; ++i) {
+		db_hashmap_slot *slot = &slots_old[data->slots_old_progress];
+		if (slot->key)
+			insert_slot(map, slots, data->capacity, slot->hash, slot->key, slot->val);
+		++data->slots_old_progress;
 	}
 
-	db_invalidate_region(map->db, &map->data->buckets_old_progress, sizeof(uint64));
+	if (data->slots_old_progress >= data->slots_old_capacity) {
+		// Everything has been moved, the previous array is not needed anymore
+		db_free(map->db, slots_old);
+		data->slots_old          = 0;
+		data->slots_old_capacity = 0;
+		data->slots_old_progress = 0;
+	}
+	db_invalidate_region(map->db, data, sizeof(db_hashmap_data));
 }
 
-static void maybe_grow(db_hashmap *map)
+// Allocates the next array, the entries are moved by resize_some()
+static void start_resize(db_hashmap *map, uint64 next_capacity)
 {
-	static const float load_factor = 4.0/2.0;
-	// Check if we have reached the grow threshold
-	if (map->data->buckets_new_capacity > 0 &&
-	    map->data->number_of_elements <= load_factor*map->data->buckets_new_capacity)
-		return;
-
-	// We should have migrated all the old data by this point, otherwise something went very wrong.
-	assert(db_unmarshal(map->db, map->data->buckets_old) == 0);
-
-	map->data->buckets_old          = map->data->buckets_new;
-	map->data->buckets_old_capacity = map->data->buckets_new_capacity;
-	map->data->buckets_old_progress = 0;
-
-	assert (map->data->buckets_old_capacity > 0);
-	map->data->buckets_new_capacity = map->data->buckets_old_capacity*2; // MUST BE 2
+	db_hashmap_data *data = map->data;
+
+	// Not cleared here, that would take time proportional to the size of the table
+	db_hashmap_slot *next_slots = db_alloc(map->db, sizeof(db_hashmap_slot)*next_capacity);
+	data->next_slots    = db_marshal(map->db, next_slots);
+	data->next_cleared  = 0;
+	data->next_capacity = next_capacity;
+	db_invalidate_region(map->db, data, sizeof(db_hashmap_data));
+}
 
-	uint64 *new_buckets = db_alloc(map->db, sizeof(uint64)*map->data->buckets_new_capacity);
-	map->data->buckets_new = db_marshal(map->db, new_buckets);
-	#if 0
-	// Might be useful for debugging.
-	// This gives an O(n) the worst case complexity and render all our efforts useless:
-	byte_zero(new_buckets, sizeof(uint64)*map->data->buckets_new_capacity);
-	db_invalidate_region(map->db, new_buckets, sizeof(uint64)*map->data->buckets_new_capacity);
-	#endif
+static void maybe_resize(db_hashmap *map)
+{
+	db_hashmap_data *data = map->data;
 
-	db_invalidate_region(map->db, map->data, sizeof(db_hashmap_data));
+	if (!data->next_slots && !data->slots_old) {
+		if (data->number_of_elements > data->capacity/2)
+			start_resize(map, 2*data->capacity);
+		else if (data->number_of_elements < data->capacity/8 && data->capacity > INITIAL_CAPACITY)
+			start_resize(map, data->capacity/2);
+	}
 
-	rehash_some(map);
+	// The steps are large enough that this should never happen, but the current array must never
+	// fill up
+	while ((data->next_slots || data->slots_old) && data->number_of_elements*8 >= data->capacity*7)
+		resize_some(map);
 }
@@ -3,15 +3,27 @@
 
 #include "db.h"
 
+// Open addressing with Robin Hood hashing. All entries are stored in a single array of slots.
+// The table grows without blocking: the array of twice the size is cleared a few slots at a time
+// during the following operations, then the entries are moved over a few slots at a time.
 typedef struct db_hashmap_data {
-	db_ptr buckets_old;
-	uint64 buckets_old_capacity;
-	uint64 buckets_old_progress;
-	db_ptr buckets_new;
-	uint64 buckets_new_capacity;
+	db_ptr slots;
+	uint64 capacity;           // Number of slots, a power of two
 	uint64 number_of_elements;
+	db_ptr next_slots;         // Next array, 0 unless it is being cleared
+	uint64 next_cleared;       // Number of slots of the next array that have been cleared
+	db_ptr slots_old;          // Previous array, 0 unless its entries are being moved
+	uint64 slots_old_capacity;
+	uint64 slots_old_progress; // All entries below this index have been moved
+	uint64 next_capacity;      // Number of slots of the next array
 } db_hashmap_data;
 
+typedef struct db_hashmap_slot {
+	uint64 hash; // Full hash of the key, compared before the key itself
+	db_ptr key;  // 0 if the slot is empty
+	db_ptr val;
+} db_hashmap_slot;
+
 typedef uint64 (*db_hash_func)(void *key, void *extra);
 typedef int    (*db_eq_func)(void *key_a, void *key_b, void *extra);
 
@@ -33,8 +45,27 @@ db_ptr  db_hashmap_marshal(db_hashmap *map);
 void    db_hashmap_insert(db_hashmap *map, void *key, void *val);
 void*   db_hashmap_get(db_hashmap  *map, void *key);
 void    db_hashmap_remove(db_hashmap *map, void *key);
+// Makes room for count entries at once, for filling a table in bulk. Takes time proportional to
+// the size of the table.
+void    db_hashmap_reserve(db_hashmap *map, uint64 count);
+void    db_hashmap_compact(db_hashmap *map, db_compaction *c);
+void    db_hashmap_upgrade(db_hashmap *map);
+void    db_hashmap_upgrade_data(db_hashmap *map);
+void    db_hashmap_free(db_hashmap *map);
 
 uint64 uint64_hash(void *value, void *extra);
 int uint64_eq(void *a, void *b, void *extra);
 
+// Makes bad hash functions more random, so the low bits can be used as the index
+// (finalizer of MurmurHash3)
+static inline uint64 db_hash_mix(uint64 val)
+{
+	val ^= val >> 33;
+	val *= 0xff51afd7ed558ccdULL;
+	val ^= val >> 33;
+	val *= 0xc4ceb3fe1a85ec53ULL;
+	val ^= val >> 33;
+	return val;
+}
+
 #endif // DB_HASHMAP_H
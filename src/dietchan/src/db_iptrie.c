@@ -0,0 +1,253 @@
+#include "db_iptrie.h"
+
+#include <libowfat/byte.h>
+
+static db_ptr* root(db_iptrie *trie, enum ip_version version, uint32 *bits);
+static int     get_bit(const unsigned char *bytes, uint32 index);
+static uint32  common_prefix(const unsigned char *a, const unsigned char *b, uint32 length);
+static db_iptrie_node* new_node(db_iptrie *trie, const unsigned char *bytes, uint32 length, db_ptr val);
+static void    set_link(db_iptrie *trie, db_ptr *link, db_ptr ptr);
+static db_ptr* find_link(db_iptrie *trie, const struct ip_range *range, db_ptr **parent_link);
+static void    prune(db_iptrie *trie, db_ptr *link);
+
+void db_iptrie_init(db_iptrie *trie, db_obj *db, db_iptrie_data *data)
+{
+	if (!data) {
+		data = db_alloc(db, sizeof(db_iptrie_data));
+		byte_zero(data, sizeof(db_iptrie_data));
+		db_invalidate_region(db, data, sizeof(db_iptrie_data));
+	}
+
+	trie->db   = db;
+	trie->data = data;
+}
+
+db_ptr db_iptrie_marshal(db_iptrie *trie)
+{
+	return db_marshal(trie->db, trie->data);
+}
+
+void db_iptrie_insert(db_iptrie *trie, const struct ip_range *range, void *val)
+{
+	uint32 bits;
+	db_ptr *link = root(trie, range->ip.version, &bits);
+	if (!link)
+		return;
+
+	const unsigned char *bytes = range->ip.bytes;
+	uint32 length = (range->range < 0)?0:(range->range > bits)?bits:range->range;
+	db_ptr ptr = db_marshal(trie->db, val);
+
+	while (1) {
+		db_iptrie_node *node = db_unmarshal(trie->db, *link);
+		if (!node) {
+			set_link(trie, link, db_marshal(trie->db, new_node(trie, bytes, length, ptr)));
+			break;
+		}
+
+		uint32 common = common_prefix(node->bytes, bytes, (node->length < length)?node->length:length);
+		if (common == node->length) {
+			if (node->length == length) {
+				if (node->val) {
+					// Already there, just update the object
+					node->val = ptr;
+					db_invalidate_region(trie->db, &node->val, sizeof(db_ptr));
+					return;
+				}
+				node->val = ptr;
+				db_invalidate_region(trie->db, &node->val, sizeof(db_ptr));
+				break;
+			}
+			link = &node->children[get_bit(bytes, node->length)];
+			continue;
+		}
+
+		// The range branches off within the prefix of the node. A new node takes the place of the
+		// existing one, with the existing one below it.
+		db_iptrie_node *parent;
+		if (common == length) {
+			parent = new_node(trie, bytes, length, ptr);
+		} else {
+			parent = new_node(trie, bytes, common, 0);
+			parent->children[get_bit(bytes, common)] =
+			        db_marshal(trie->db, new_node(trie, bytes, length, ptr));
+		}
+		parent->children[get_bit(node->bytes, common)] = *link;
+		db_invalidate_region(trie->db, parent, sizeof(db_iptrie_node));
+		set_link(trie, link, db_marshal(trie->db, parent));
+		break;
+	}
+
+	++trie->data->number_of_elements;
+	db_invalidate_region(trie->db, &trie->data->number_of_elements, sizeof(uint64));
+}
+
+void* db_iptrie_get(db_iptrie *trie, const struct ip_range *range)
+{
+	db_ptr *link = find_link(trie, range, 0);
+	if (!link)
+		return 0;
+	db_iptrie_node *node = db_unmarshal(trie->db, *link);
+	return db_unmarshal(trie->db, node->val);
+}
+
+void db_iptrie_remove(db_iptrie *trie, const struct ip_range *range)
+{
+	db_ptr *parent_link = 0;
+	db_ptr *link = find_link(trie, range, &parent_link);
+	if (!link)
+		return;
+	db_iptrie_node *node = db_unmarshal(trie->db, *link);
+	if (!node->val)
+		return;
+
+	node->val = 0;
+	db_invalidate_region(trie->db, &node->val, sizeof(db_ptr));
+	prune(trie, link);
+	if (parent_link)
+		prune(trie, parent_link);
+
+	--trie->data->number_of_elements;
+	db_invalidate_region(trie->db, &trie->data->number_of_elements, sizeof(uint64));
+}
+
+void db_iptrie_find(db_iptrie *trie, const struct ip *ip, db_iptrie_callback callback, void *extra)
+{
+	uint32 bits;
+	db_ptr *link = root(trie, ip->version, &bits);
+	if (!link)
+		return;
+
+	// Every node is longer than its parent. Counting the depth keeps a reader of a database that is
+	// being changed by another process from looping forever.
+	db_iptrie_node *node = db_unmarshal(trie->db, *link);
+	for (uint32 depth=0; node && depth<=bits; ++depth) {
+		if (common_prefix(node->bytes, ip->bytes, node->length) < node->length)
+			return;
+		if (node->val)
+			callback(db_unmarshal(trie->db, node->val), extra);
+		if (node->length == bits)
+			return;
+		node = db_unmarshal(trie->db, node->children[get_bit(ip->bytes, node->length)]);
+	}
+}
+
+static void compact_node(db_iptrie *trie, db_compaction *c, db_ptr *link)
+{
+	db_iptrie_node *node = db_unmarshal(trie->db, *link);
+	if (!node)
+		return;
+	db_compact_object(c, node);
+	compact_node(trie, c, &node->children[0]);
+	compact_node(trie, c, &node->children[1]);
+	db_compact_pointer(c, &node->children[0]);
+	db_compact_pointer(c, &node->children[1]);
+	db_compact_pointer(c, &node->val);
+}
+
+void db_iptrie_compact(db_iptrie *trie, db_compaction *c)
+{
+	db_compact_object(c, trie->data);
+	compact_node(trie, c, &trie->data->root_v4);
+	compact_node(trie, c, &trie->data->root_v6);
+	db_compact_pointer(c, &trie->data->root_v4);
+	db_compact_pointer(c, &trie->data->root_v6);
+}
+
+static void free_node(db_iptrie *trie, db_iptrie_node *node)
+{
+	if (!node)
+		return;
+	free_node(trie, db_unmarshal(trie->db, node->children[0]));
+	free_node(trie, db_unmarshal(trie->db, node->children[1]));
+	db_free(trie->db, node);
+}
+
+void db_iptrie_free(db_iptrie *trie)
+{
+	free_node(trie, db_unmarshal(trie->db, trie->data->root_v4));
+	free_node(trie, db_unmarshal(trie->db, trie->data->root_v6));
+	db_free(trie->db, trie->data);
+	trie->data = 0;
+}
+
+// --- Internal ---
+
+static db_ptr* root(db_iptrie *trie, enum ip_version version, uint32 *bits)
+{
+	switch (version) {
+		case IP_V4: *bits =  32; return &trie->data->root_v4;
+		case IP_V6: *bits = 128; return &trie->data->root_v6;
+		default:    return 0;
+	}
+}
+
+static int get_bit(const unsigned char *bytes, uint32 index)
+{
+	return (bytes[index/8] >> (7 - index%8)) & 1;
+}
+
+// Number of leading bits that are the same, at most length
+static uint32 common_prefix(const unsigned char *a, const unsigned char *b, uint32 length)
+{
+	for (uint32 i=0; i<length; i+=8) {
+		unsigned char diff = a[i/8] ^ b[i/8];
+		if (diff) {
+			i += __builtin_clz(diff) - 24;
+			return (i < length)?i:length;
+		}
+	}
+	return length;
+}
+
+static db_iptrie_node* new_node(db_iptrie *trie, const unsigned char *bytes, uint32 length, db_ptr val)
+{
+	db_iptrie_node *node = db_alloc(trie->db, sizeof(db_iptrie_node));
+	byte_zero(node, sizeof(db_iptrie_node));
+	byte_copy(node->bytes, (length+7)/8, bytes);
+	if (length%8)
+		node->bytes[length/8] &= 0xFF << (8 - length%8);
+	node->length = length;
+	node->val    = val;
+	db_invalidate_region(trie->db, node, sizeof(db_iptrie_node));
+	return node;
+}
+
+static void set_link(db_iptrie *trie, db_ptr *link, db_ptr ptr)
+{
+	*link = ptr;
+	db_invalidate_region(trie->db, link, sizeof(db_ptr));
+}
+
+// Returns the link to the node of exactly the given range, 0 if there is none
+static db_ptr* find_link(db_iptrie *trie, const struct ip_range *range, db_ptr **parent_link)
+{
+	uint32 bits;
+	db_ptr *link = root(trie, range->ip.version, &bits);
+	if (!link)
+		return 0;
+	uint32 length = (range->range < 0)?0:(range->range > bits)?bits:range->range;
+
+	while (1) {
+		db_iptrie_node *node = db_unmarshal(trie->db, *link);
+		if (!node || node->length > length)
+			return 0;
+		if (common_prefix(node->bytes, range->ip.bytes, node->length) < node->length)
+			return 0;
+		if (node->length == length)
+			return link;
+		if (parent_link)
+			*parent_link = link;
+		link = &node->children[get_bit(range->ip.bytes, node->length)];
+	}
+}
+
+// Removes a node that neither has an object nor joins two children
+static void prune(db_iptrie *trie, db_ptr *link)
+{
+	db_iptrie_node *node = db_unmarshal(trie->db, *link);
+	if (!node || node->val || (node->children[0] && node->children[1]))
+		return;
+	set_link(trie, link, node->children[0]?node->children[0]:node->children[1]);
+	db_free(trie->db, node);
+}
@@ -0,0 +1,40 @@
+#ifndef DB_IPTRIE_H
+#define DB_IPTRIE_H
+
+#include "db.h"
+#include "ip.h"
+
+// Patricia trie of IP ranges, one for every IP version. Each range is mapped to an object. A single
+// walk down the trie finds all ranges that contain an address.
+
+typedef struct db_iptrie_node {
+	unsigned char bytes[16]; // Prefix, the bits after it are zero
+	uint32 length;           // Length of the prefix in bits
+	db_ptr children[2];      // Continue with the next bit after the prefix
+	db_ptr val;              // 0 if the node only joins its children
+} db_iptrie_node;
+
+typedef struct db_iptrie_data {
+	db_ptr root_v4;
+	db_ptr root_v6;
+	uint64 number_of_elements;
+} db_iptrie_data;
+
+typedef struct db_iptrie {
+	db_obj         *db;
+	db_iptrie_data *data;
+} db_iptrie;
+
+typedef void (*db_iptrie_callback)(void *val, void *extra);
+
+void    db_iptrie_init(db_iptrie *trie, db_obj *db, db_iptrie_data *data);
+db_ptr  db_iptrie_marshal(db_iptrie *trie);
+void    db_iptrie_insert(db_iptrie *trie, const struct ip_range *range, void *val); // Replaces the previous object
+void*   db_iptrie_get(db_iptrie *trie, const struct ip_range *range);
+void    db_iptrie_remove(db_iptrie *trie, const struct ip_range *range);
+// Calls back for every range that contains the address, shortest range first
+void    db_iptrie_find(db_iptrie *trie, const struct ip *ip, db_iptrie_callback callback, void *extra);
+void    db_iptrie_compact(db_iptrie *trie, db_compaction *c);
+void    db_iptrie_free(db_iptrie *trie);
+
+#endif // DB_IPTRIE_H
@@ -0,0 +1,306 @@
+#include "db_u64map.h"
+#include "db_hashmap.h"
+
+#include <libowfat/byte.h>
+
+// Marks a slot of the previous array whose entry has been removed, see db_hashmap.c
+#define TOMBSTONE (~0UL)
+
+#define INITIAL_CAPACITY 64
+#define CLEAR_STEP   16
+#define MIGRATE_STEP 16
+
+static db_u64map_slot* find_slot(db_u64map_slot *slots, uint64 capacity, uint64 skip_below, uint64 key);
+static void   insert_slot(db_u64map *map, db_u64map_slot *slots, uint64 capacity, uint64 key, db_ptr val);
+static void   remove_slot(db_u64map *map, db_u64map_slot *slots, uint64 capacity, uint64 index);
+static void   resize_some(db_u64map *map);
+static void   maybe_resize(db_u64map *map);
+
+void db_u64map_init(db_u64map *map, db_obj *db, db_u64map_data *data)
+{
+	if (!data) {
+		data = db_alloc(db, sizeof(db_u64map_data));
+		byte_zero(data, sizeof(db_u64map_data));
+
+		data->capacity = INITIAL_CAPACITY;
+		db_u64map_slot *slots = db_alloc(db, sizeof(db_u64map_slot)*data->capacity);
+		byte_zero(slots, sizeof(db_u64map_slot)*data->capacity);
+		db_invalidate_region(db, slots, sizeof(db_u64map_slot)*data->capacity);
+		data->slots = db_marshal(db, slots);
+
+		db_invalidate_region(db, data, sizeof(db_u64map_data));
+	}
+
+	map->db   = db;
+	map->data = data;
+}
+
+db_ptr db_u64map_marshal(db_u64map *map)
+{
+	return db_marshal(map->db, map->data);
+}
+
+void db_u64map_insert(db_u64map *map, uint64 key, void *val)
+{
+	resize_some(map);
+
+	insert_slot(map, db_unmarshal(map->db, map->data->slots), map->data->capacity, key,
+	            db_marshal(map->db, val));
+
+	++(map->data->number_of_elements);
+	db_invalidate_region(map->db, &map->data->number_of_elements, sizeof(uint64));
+	maybe_resize(map);
+}
+
+void* db_u64map_get(db_u64map *map, uint64 key)
+{
+	db_u64map_slot *slot = find_slot(db_unmarshal(map->db, map->data->slots), map->data->capacity, 0, key);
+	if (!slot && map->data->slots_old) {
+		// Not moved yet
+		slot = find_slot(db_unmarshal(map->db, map->data->slots_old), map->data->slots_old_capacity,
+		                 map->data->slots_old_progress, key);
+	}
+	return slot?db_unmarshal(map->db, slot->val):0;
+}
+
+void db_u64map_remove(db_u64map *map, uint64 key)
+{
+	resize_some(map);
+
+	db_u64map_slot *slots = db_unmarshal(map->db, map->data->slots);
+	db_u64map_slot *slot = find_slot(slots, map->data->capacity, 0, key);
+	if (slot) {
+		remove_slot(map, slots, map->data->capacity, slot - slots);
+	} else if (map->data->slots_old) {
+		slot = find_slot(db_unmarshal(map->db, map->data->slots_old), map->data->slots_old_capacity,
+		                 map->data->slots_old_progress, key);
+		if (!slot)
+			return;
+		slot->key = TOMBSTONE;
+		slot->val = 0;
+		db_invalidate_region(map->db, slot, sizeof(db_u64map_slot));
+	} else {
+		return;
+	}
+
+	--(map->data->number_of_elements);
+	db_invalidate_region(map->db, &map->data->number_of_elements, sizeof(uint64));
+	maybe_resize(map);
+}
+
+void db_u64map_reserve(db_u64map *map, uint64 count)
+{
+	db_u64map_data *data = map->data;
+
+	while (data->next_slots || data->slots_old)
+		resize_some(map);
+
+	uint64 capacity = data->capacity;
+	while (capacity/2 < count)
+		capacity *= 2;
+	if (capacity == data->capacity)
+		return;
+
+	db_u64map_slot *slots = db_alloc(map->db, sizeof(db_u64map_slot)*capacity);
+	byte_zero(slots, sizeof(db_u64map_slot)*capacity);
+	db_u64map_slot *slots_old = db_unmarshal(map->db, data->slots);
+	for (uint64 i=0; i<data->capacity; ++i) {
+		if (slots_old[i].val)
+			insert_slot(map, slots, capacity, slots_old[i].key, slots_old[i].val);
+	}
+	db_invalidate_region(map->db, slots, sizeof(db_u64map_slot)*capacity);
+	db_free(map->db, slots_old);
+
+	data->slots    = db_marshal(map->db, slots);
+	data->capacity = capacity;
+	db_invalidate_region(map->db, data, sizeof(db_u64map_data));
+}
+
+void db_u64map_compact(db_u64map *map, db_compaction *c)
+{
+	// Finish a pending resize first, then only the current array is in use
+	while (map->data->next_slots || map->data->slots_old)
+		resize_some(map);
+
+	db_compact_object(c, map->data);
+	db_compact_pointer(c, &map->data->slots);
+	db_compact_pointer(c, &map->data->next_slots);
+	db_compact_pointer(c, &map->data->slots_old);
+
+	db_u64map_slot *slots = db_unmarshal(map->db, map->data->slots);
+	db_compact_object(c, slots);
+	for (uint64 i=0; i<map->data->capacity; ++i) {
+		if (slots[i].val)
+			db_compact_pointer(c, &slots[i].val);
+	}
+}
+
+void db_u64map_upgrade_data(db_u64map *map)
+{
+	db_u64map_data *data = db_realloc(map->db, map->data, sizeof(db_u64map_data));
+	data->next_capacity = data->next_slots?2*data->capacity:0;
+	db_invalidate_region(map->db, data, sizeof(db_u64map_data));
+	map->data = data;
+}
+
+// --- Internal ---
+
+static inline uint64 home_slot(uint64 key, uint64 capacity)
+{
+	return db_hash_mix(key) & (capacity-1);
+}
+
+static inline uint64 probe_distance(db_u64map_slot *slot, uint64 index, uint64 capacity)
+{
+	return (index - home_slot(slot->key, capacity)) & (capacity-1);
+}
+
+// Slots below skip_below are treated as removed, their entries have been moved to the current
+// array
+static db_u64map_slot* find_slot(db_u64map_slot *slots, uint64 capacity, uint64 skip_below, uint64 key)
+{
+	if (!slots)
+		return 0;
+	uint64 index = home_slot(key, capacity);
+	uint64 distance = 0;
+	while (distance < capacity) {
+		if (index < skip_below) {
+			// Jump over the moved slots instead of walking through them
+			if (skip_below >= capacity)
+				return 0;
+			distance += skip_below - index;
+			index = skip_below;
+			continue;
+		}
+		db_u64map_slot *slot = &slots[index];
+		if (!slot->val) {
+			if (slot->key != TOMBSTONE)
+				return 0;
+		} else {
+			if (slot->key == key)
+				return slot;
+			if (probe_distance(slot, index, capacity) < distance)
+				return 0;
+		}
+		index = (index+1) & (capacity-1);
+		++distance;
+	}
+	return 0;
+}
+
+static void insert_slot(db_u64map *map, db_u64map_slot *slots, uint64 capacity, uint64 key, db_ptr val)
+{
+	db_u64map_slot entry;
+	entry.key = key;
+	entry.val = val;
+
+	uint64 index = home_slot(key, capacity);
+	uint64 distance = 0;
+	while (1) {
+		db_u64map_slot *slot = &slots[index];
+		if (!slot->val) {
+			*slot = entry;
+			db_invalidate_region(map->db, slot, sizeof(db_u64map_slot));
+			return;
+		}
+		uint64 slot_distance = probe_distance(slot, index, capacity);
+		if (slot_distance < distance) {
+			db_u64map_slot displaced = *slot;
+			*slot = entry;
+			db_invalidate_region(map->db, slot, sizeof(db_u64map_slot));
+			entry = displaced;
+			distance = slot_distance;
+		}
+		index = (index+1) & (capacity-1);
+		++distance;
+	}
+}
+
+static void remove_slot(db_u64map *map, db_u64map_slot *slots, uint64 capacity, uint64 index)
+{
+	while (1) {
+		uint64 next = (index+1) & (capacity-1);
+		if (!slots[next].val || probe_distance(&slots[next], next, capacity) == 0)
+			break;
+		slots[index] = slots[next];
+		db_invalidate_region(map->db, &slots[index], sizeof(db_u64map_slot));
+		index = next;
+	}
+	byte_zero(&slots[index], sizeof(db_u64map_slot));
+	db_invalidate_region(map->db, &slots[index], sizeof(db_u64map_slot));
+}
+
+static void resize_some(db_u64map *map)
+{
+	db_u64map_data *data = map->data;
+
+	if (data->next_slots) {
+		uint64 next_capacity = data->next_capacity;
+		uint64 count = next_capacity - data->next_cleared;
+		if (count > CLEAR_STEP)
+			count = CLEAR_STEP;
+		db_u64map_slot *next_slots = db_unmarshal(map->db, data->next_slots);
+		byte_zero(&next_slots[data->next_cleared], sizeof(db_u64map_slot)*count);
+		db_invalidate_region(map->db, &next_slots[data->next_cleared], sizeof(db_u64map_slot)*count);
+		data->next_cleared += count;
+
+		if (data->next_cleared == next_capacity) {
+			data->slots_old          = data->slots;
+			data->slots_old_capacity = data->capacity;
+			data->slots_old_progress = 0;
+			data->slots              = data->next_slots;
+			data->capacity           = next_capacity;
+			data->next_slots         = 0;
+			data->next_cleared       = 0;
+			data->next_capacity      = 0;
+		}
+		db_invalidate_region(map->db, data, sizeof(db_u64map_data));
+		return;
+	}
+
+	if (!data->slots_old)
+		return;
+
+	db_u64map_slot *slots     = db_unmarshal(map->db, data->slots);
+	db_u64map_slot *slots_old = db_unmarshal(map->db, data->slots_old);
+	for (uint64 i=0; i<MIGRATE_STEP && data->slots_old_progress<data->slots_old_capacity; ++i) {
+		db_u64map_slot *slot = &slots_old[data->slots_old_progress];
+		if (slot->val)
+			insert_slot(map, slots, data->capacity, slot->key, slot->val);
+		++data->slots_old_progress;
+	}
+
+	if (data->slots_old_progress >= data->slots_old_capacity) {
+		db_free(map->db, slots_old);
+		data->slots_old          = 0;
+		data->slots_old_capacity = 0;
+		data->slots_old_progress = 0;
+	}
+	db_invalidate_region(map->db, data, sizeof(db_u64map_data));
+}
+
+static void start_resize(db_u64map *map, uint64 next_capacity)
+{
+	db_u64map_data *data = map->data;
+
+	db_u64map_slot *next_slots = db_alloc(map->db, sizeof(db_u64map_slot)*next_capacity);
+	data->next_slots    = db_marshal(map->db, next_slots);
+	data->next_cleared  = 0;
+	data->next_capacity = next_capacity;
+	db_invalidate_region(map->db, data, sizeof(db_u64map_data));
+}
+
+static void maybe_resize(db_u64map *map)
+{
+	db_u64map_data *data = map->data;
+
+	if (!data->next_slots && !data->slots_old) {
+		if (data->number_of_elements > data->capacity/2)
+			start_resize(map, 2*data->capacity);
+		else if (data->number_of_elements < data->capacity/8 && data->capacity > INITIAL_CAPACITY)
+			start_resize(map, data->capacity/2);
+	}
+
+	while ((data->next_slots || data->slots_old) && data->number_of_elements*8 >= data->capacity*7)
+		resize_some(map);
+}
@@ -0,0 +1,39 @@
+#ifndef DB_U64MAP_H
+#define DB_U64MAP_H
+
+#include "db.h"
+
+// Hash table with uint64 keys. Works like db_hashmap, but the keys are stored in the slots next
+// to the values, so lookups neither call back nor read the objects.
+typedef struct db_u64map_data {
+	db_ptr slots;
+	uint64 capacity;           // Number of slots, a power of two
+	uint64 number_of_elements;
+	db_ptr next_slots;         // Next array, 0 unless it is being cleared
+	uint64 next_cleared;       // Number of slots of the next array that have been cleared
+	db_ptr slots_old;          // Previous array, 0 unless its entries are being moved
+	uint64 slots_old_capacity;
+	uint64 slots_old_progress; // All entries below this index have been moved
+	uint64 next_capacity;      // Number of slots of the next array
+} db_u64map_data;
+
+typedef struct db_u64map_slot {
+	uint64 key;
+	db_ptr val; // 0 if the slot is empty
+} db_u64map_slot;
+
+typedef struct db_u64map {
+	db_obj         *db;
+	db_u64map_data *data;
+} db_u64map;
+
+void    db_u64map_init(db_u64map *map, db_obj *db, db_u64map_data *data);
+db_ptr  db_u64map_marshal(db_u64map *map);
+void    db_u64map_insert(db_u64map *map, uint64 key, void *val);
+void*   db_u64map_get(db_u64map *map, uint64 key);
+void    db_u64map_remove(db_u64map *map, uint64 key);
+void    db_u64map_reserve(db_u64map *map, uint64 count);
+void    db_u64map_compact(db_u64map *map, db_compaction *c);
+void    db_u64map_upgrade_data(db_u64map *map);
+
+#endif // DB_U64MAP_H
@@ -2,9 +2,14 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 #include <signal.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <setjmp.h>
 #include <libowfat/socket.h>
 #include <libowfat/ip4.h>
 #include <libowfat/io.h>
@@ -22,10 +27,13 @@
 #include "db_hashmap.h"
 #include "persistence.h"
 #include "captcha.h"
+#include "bans.h"
+#include "session.h"
 #include "tpl.h"
 
 #include "export.h"
 #include "import.h"
+#include "vacuum.h"
 
 #include "pages/static.h"
 #include "pages/post.h"
@@ -34,6 +42,7 @@
 #include "pages/mod.h"
 #include "pages/login.h"
 #include "pages/dashboard.h"
+#include "pages/stats.h"
 #include "pages/edit_user.h"
 #include "pages/edit_board.h"
 #include "pages/banned.h"
@@ -63,6 +72,17 @@ static int  default_finish (http_context *http)
 	HTTP_FAIL(INTERNAL_SERVER_ERROR);
 }
 
+// Pages that may modify the database
+static int modifies_database(const char *path)
+{
+	return str_equal(path, PREFIX "/post") ||
+	       str_equal(path, PREFIX "/mod") ||
+	       str_equal(path, PREFIX "/login") ||
+	       str_start(path, PREFIX "/dashboard") ||
+	       str_start(path, PREFIX "/edit_user") ||
+	       str_start(path, PREFIX "/edit_board");
+}
+
 int request (http_context *http, http_method method, char *path, char *query)
 {
 	http->get_param    = default_get_param;
@@ -72,6 +92,13 @@ int request (http_context *http, http_method method, char *path, char *query)
 	http->file_end     = default_file_end;
 	http->finish       = default_finish;
 
+	// Replicas and worker processes only serve pages that do not modify the database
+	if (read_only && modifies_database(path)) {
+		http->error_status = 503;
+		http->error_message = "Service Unavailable";
+		return ERROR;
+	}
+
 	if (str_equal(path, PREFIX "/post")) {
 		post_page_init(http);
 		goto found;
@@ -87,6 +114,11 @@ int request (http_context *http, http_method method, char *path, char *query)
 		goto found;
 	}
 
+	if (str_equal(path, PREFIX "/dashboard/stats")) {
+		stats_page_init(http);
+		goto found;
+	}
+
 	if (str_start(path, PREFIX "/dashboard")) {
 		dashboard_page_init(http);
 		goto found;
@@ -148,43 +180,329 @@ static void error (http_context *http)
 struct listener {
 	int64 socket;
 	struct ip ip;
+	uint16 port;
 };
 // 64 listeners ought to be enough for anyone
 struct listener listeners[64];
 size_t listener_count;
 
+// -- Worker processes --
+// Every worker opens its own listeners on the same ports (SO_REUSEPORT), so the kernel spreads the
+// connections over all processes. A worker maps the database read-only and renders the GET
+// requests for pages that do not modify it. Every other request is passed on to the writer
+// process, together with the bytes that were already read from the connection.
+// The writer keeps changing the database file while the workers read it. A page is rendered again
+// if the database has changed in the meantime, see db_read_begin().
+
+struct worker {
+	int64 channel; // Writer's end of the socket pair that connections are passed through
+	pid_t pid;
+};
+#define MAX_WORKERS 64
+struct worker workers[MAX_WORKERS];
+size_t worker_count;
+static unsigned long worker_processes = WORKER_PROCESSES;
+
+// Worker: the other end of the socket pair, -1 in the writer process
+static int64 writer_channel = -1;
+
+// Sent along with a connection that is passed to the writer, followed by the bytes that were
+// already read from it
+struct forwarded_connection {
+	struct ip ip;
+	uint16 port;
+};
+
+// Sent by a worker when a request used a session, so that the writer can update last_seen. Unlike
+// a forwarded connection, it does not carry a descriptor.
+struct session_message {
+	uint64 time;
+	char   sid[SESSION_SID_LENGTH+1];
+};
+
+// Limit for the request line and headers collected by a worker before they are parsed
+#define MAX_BUFFERED_REQUEST (MAX_REQUEST_LINE_LENGTH + 32*MAX_HEADER_LENGTH)
+
 static char buf[8192];
 
+static http_context* new_connection(int64 s, struct ip ip, uint16 port)
+{
+	io_nonblock(s);
+
+	http_context *http = http_new(s);
+
+	http->ip      = ip;
+	http->port    = port;
+	http->request = request;
+	http->error   = error;
+	return http;
+}
+
 void accept_connections(int64 s, struct listener *listener, int limit)
 {
 	for (int i=0; i<limit; ++i) {
-		char ip[16] = {0};
+		struct ip ip = {0};
 		uint16 port;
 		int64 a;
 		uint32 scope;
+		ip.version = listener->ip.version;
 		switch(listener->ip.version) {
-			case IP_V4: a = socket_accept4(s, ip, &port); break;
-			case IP_V6: a = socket_accept6(s, ip, &port, &scope); break;
+			case IP_V4: a = socket_accept4(s, (char*)ip.bytes, &port); break;
+			case IP_V6: a = socket_accept6(s, (char*)ip.bytes, &port, &scope); break;
 		}
 		if (a==-1)
 			io_eagain_read(s);
 		if (a<0) return;
 
-		io_nonblock(a);
+		new_connection(a, ip, port);
+	}
+}
 
-		http_context *http = http_new(a);
+// Writer: takes over the connections passed on by a worker
+static void receive_connections(int64 s, struct worker *worker)
+{
+	static char data[sizeof(struct forwarded_connection) + MAX_BUFFERED_REQUEST + sizeof(buf)];
+	while (1) {
+		union {
+			struct cmsghdr header;
+			char buf[CMSG_SPACE(sizeof(int))];
+		} control;
+		struct iovec iov = { data, sizeof(data) };
+		struct msghdr msg;
+		byte_zero(&msg, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+
+		ssize_t ret = recvmsg(s, &msg, MSG_DONTWAIT);
+		if (ret < 0 && errno == EAGAIN) {
+			io_eagain_read(s);
+			return;
+		}
+		if (ret <= 0) {
+			// No replacement is started: a process forked now would share the io_wait
+			// registrations and the client connections of the writer. The kernel spreads the
+			// connections over the remaining processes, the writer still serves everything.
+			int status;
+			waitpid(worker->pid, &status, 0);
+			io_dontwantread(s);
+			io_close(s);
+			worker->channel = -1;
+			size_t running = 0;
+			for (size_t i=0; i<worker_count; ++i)
+				running += (workers[i].channel != -1);
+			fprintf(stderr, "Worker process %d has exited, running degraded with %d of %d workers. "
+			                "Restart the server to start new ones.\n",
+			        (int)worker->pid, (int)running, (int)worker_count);
+			return;
+		}
 
-		http->ip.version = listener->ip.version;
-		byte_copy(&http->ip.bytes, sizeof(ip), ip);
-		http->port = port;
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+			if (ret == sizeof(struct session_message)) {
+				struct session_message *message = (struct session_message*)data;
+				message->sid[SESSION_SID_LENGTH] = '\0';
+				struct session *session = find_session_by_sid(message->sid);
+				if (session)
+					session_seen(session, message->time);
+			}
+			continue;
+		}
+		int fd;
+		byte_copy(&fd, sizeof(int), CMSG_DATA(cmsg));
+		if (ret < sizeof(struct forwarded_connection) || (msg.msg_flags & MSG_TRUNC)) {
+			close(fd);
+			continue;
+		}
+
+		struct forwarded_connection *header = (struct forwarded_connection*)data;
+		http_context *http = new_connection(fd, header->ip, header->port);
+		context_read(&http->parent_instance, data + sizeof(struct forwarded_connection),
+		             ret - sizeof(struct forwarded_connection));
+	}
+}
 
-		http->request = request;
-		http->error   = error;
+// Worker: passes the connection on to the writer and forgets about it
+static void forward_connection(http_context *http)
+{
+	context *ctx = &http->parent_instance;
+
+	struct forwarded_connection header;
+	header.ip   = http->ip;
+	header.port = http->port;
+
+	struct iovec iov[2] = {
+		{ &header, sizeof(header) },
+		{ array_start(&http->request_buffer), array_bytes(&http->request_buffer) }
+	};
+	union {
+		struct cmsghdr header;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	byte_zero(&control, sizeof(control));
+	struct msghdr msg;
+	byte_zero(&msg, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type  = SCM_RIGHTS;
+	cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+	int fd = ctx->fd;
+	byte_copy(CMSG_DATA(cmsg), sizeof(int), &fd);
+
+	if (sendmsg(writer_channel, &msg, 0) < 0) {
+		// The writer is busy or gone. Answer the request here, the rest of it is discarded.
+		perror("Could not pass connection to the writer");
+		http->error_status = 503;
+		http->error_message = "Service Unavailable";
+		error(http);
+		ctx->error = 1;
+		return;
+	}
+
+	// The writer has its own descriptor of the connection now
+	io_dontwantread(ctx->fd);
+	context_unref(ctx);
+}
+
+// Worker: tells the writer that a session was used. Lost if the channel is full, the next request
+// of the session will tell it again.
+static void send_session_seen(struct session *session, uint64 time)
+{
+	struct session_message message;
+	byte_zero(&message, sizeof(message));
+	message.time = time;
+	const char *sid = session_sid(session);
+	size_t length = str_len(sid);
+	byte_copy(message.sid, (length < SESSION_SID_LENGTH)?length:SESSION_SID_LENGTH, sid);
+	send(writer_channel, &message, sizeof(message), MSG_DONTWAIT);
+}
+
+// Worker: whether the request must be handled by the writer. Only needs the request line.
+static int is_write_request(const char *line, size_t length)
+{
+	if (!str_start(line, "GET ") && !str_start(line, "HEAD "))
+		return 1;
+
+	const char *start = line + str_chr(line, ' ') + 1;
+	size_t path_length = byte_chr(start, line + length - start, ' ');
+	path_length = byte_chr(start, path_length, '?');
+
+	char path[MAX_REQUEST_LINE_LENGTH+1];
+	if (path_length > MAX_REQUEST_LINE_LENGTH)
+		return 0;
+	byte_copy(path, path_length, start);
+	path[path_length] = '\0';
+	return modifies_database(path);
+}
+
+static sigjmp_buf render_abort;
+static volatile sig_atomic_t rendering;
+
+// Inconsistent data can make a page follow a garbage pointer into a part of the database file that
+// is not mapped yet. That is harmless if the database has changed since the page was started, it
+// is simply rendered again. Loops over the database check read_outdated() instead, jumping out of
+// arbitrary code is only safe for faulting reads of the database.
+static void handle_render_fault(int sig, siginfo_t *info, void *context)
+{
+	if (rendering && db_contains(db, info->si_addr) && read_outdated())
+		siglongjmp(render_abort, 1);
+
+	// A real bug. Returning re-executes the faulting instruction, which then crashes as usual.
+	signal(sig, SIG_DFL);
+}
+
+// Worker: parses the collected request and renders the page. The response is only sent if the
+// database has not changed in the meantime, otherwise everything is started over.
+static void render_request(http_context *http)
+{
+	context *ctx = &http->parent_instance;
+	size_t length = array_bytes(&http->request_buffer);
+	// The parser modifies the data it is given
+	char *request = malloc(length);
+
+	while (1) {
+		read_begin();
+		byte_copy(request, length, array_start(&http->request_buffer));
+
+		context_hold_output();
+		if (sigsetjmp(render_abort, 1) == 0) {
+			rendering = 1;
+			context_read(ctx, request, length);
+			rendering = 0;
+			if (!read_outdated())
+				break;
+		}
+		rendering = 0;
+		http_reset(http);
+	}
+
+	read_end();
+	free(request);
+	array_reset(&http->request_buffer);
+	context_release_output();
+}
+
+// Worker: collects the request until it can be decided who handles it
+static void worker_read_data(int64 s, http_context *http)
+{
+	context *ctx = &http->parent_instance;
+
+	while (1) {
+		int64 ret=io_tryread(s, buf, sizeof(buf));
+		if (ret == -1)
+			return;
+
+		if (ret <= 0) {
+			io_dontwantread(s);
+			context_unref(ctx);
+			return;
+		}
+
+		// Once the request has been parsed, everything else goes directly to the parser
+		if (http->state != HTTP_STATE_REQUEST || ctx->error) {
+			context_read(ctx, buf, ret);
+			continue;
+		}
+
+		array_catb(&http->request_buffer, buf, ret);
+		char  *request = array_start(&http->request_buffer);
+		size_t length  = array_bytes(&http->request_buffer);
+
+		size_t line_length = byte_str(request, length, "\r\n");
+		if (line_length == length && length <= MAX_REQUEST_LINE_LENGTH)
+			continue;
+		if (line_length < length) {
+			request[line_length] = '\0';
+			int forward = is_write_request(request, line_length);
+			request[line_length] = '\r';
+			if (forward) {
+				forward_connection(http);
+				return;
+			}
+		}
+
+		// A GET request has no body, it is complete after the headers. Requests that are too long
+		// are left to the parser to reject.
+		if (byte_str(request, length, "\r\n\r\n") == length && length <= MAX_BUFFERED_REQUEST)
+			continue;
+
+		render_request(http);
 	}
 }
 
 void read_data(int64 s, context *ctx, int64 bytes_limit)
 {
+	if (writer_channel != -1) {
+		worker_read_data(s, (http_context*)ctx);
+		return;
+	}
+
 	int64 bytes_read = 0;
 
 	// I'm not sure if we can actually read only part of the available bytes or if this may cause us
@@ -219,14 +537,26 @@ int is_listener(void *cookie)
 	        (char*)cookie < (char*)(listeners + sizeof(listeners)));
 }
 
+int is_worker(void *cookie)
+{
+	return ((struct worker*)cookie >= workers &&
+	        (struct worker*)cookie < workers + worker_count);
+}
+
 int handle_read_events(int limit)
 {
 	for (int i=0; i<limit; ++i) {
 		int64 s=io_canread();
 		if (s == -1)
 			return 0;
+		// The writer never sends anything to a worker, so the channel only becomes readable when
+		// the writer has exited
+		if (s == writer_channel)
+			exit(0);
 		void *cookie = io_getcookie(s);
-		if (is_listener(cookie)) {
+		if (is_worker(cookie)) {
+			receive_connections(s, cookie);
+		} else if (is_listener(cookie)) {
 			accept_connections(s, cookie, 1000);
 		} else {
 			read_data(s, cookie, 1);
@@ -256,13 +586,30 @@ int handle_write_events(int limit)
 
 void add_listener(struct ip ip, uint16 port)
 {
+	struct listener *listener = listeners + listener_count;
+	listener->socket = -1;
+	listener->ip = ip;
+	listener->port = port;
+	++listener_count;
+}
+
+// The writer and the workers all listen on the same ports
+static void share_port(int64 s)
+{
+	int one = 1;
+	if (worker_processes && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1)
+		perror("setsockopt(SO_REUSEPORT)");
+}
+
+static void open_listener(struct listener *listener)
+{
+	struct ip ip = listener->ip;
+	uint16 port = listener->port;
+
 	char buf[256];
 	buf[fmt_ip(buf,&ip)] = '\0';
 	fprintf(stderr, "Creating listener on port %d for address %s\n", (int)port, buf);
 
-	struct listener *listener = listeners + listener_count;
-	listener->ip = ip;
-
 	int64 s=-1;
 	int ret=0;
 	switch (ip.version) {
@@ -270,6 +617,7 @@ void add_listener(struct ip ip, uint16 port)
 		s = socket_tcp4();
 		if (s == -1)
 			perror("socket_tcp4");
+		share_port(s);
 		ret = socket_bind4_reuse(s, &ip.bytes[0], port);
 		if (ret == -1)
 			perror("socket_bind4");
@@ -278,6 +626,7 @@ void add_listener(struct ip ip, uint16 port)
 		s = socket_tcp6();
 		if (s == -1)
 			perror("socket_tcp6");
+		share_port(s);
 		ret = socket_bind6_reuse(s, &ip.bytes[0], port, 0);
 		if (ret == -1)
 			perror("socket_bind6");
@@ -294,16 +643,164 @@ void add_listener(struct ip ip, uint16 port)
 	io_setcookie(s, listener);
 
 	listener->socket = s;
+}
 
-	++listener_count;
+static void open_listeners()
+{
+	for (size_t i=0; i<listener_count; ++i)
+		open_listener(&listeners[i]);
+}
+
+// Milliseconds until the next ban expires, -1 if there is none
+static int64 ban_purge_timeout()
+{
+	int64 expiry = next_ban_expiry();
+	if (expiry < 0)
+		return -1;
+	int64 now = time(NULL);
+	return (expiry < now)?0:(expiry - now + 1)*1000;
+}
+
+// Expired bans are no longer enforced, but they are only removed from the database a few at a
+// time when there are no requests left to handle.
+static void purge_bans()
+{
+	if (ban_purge_timeout() != 0)
+		return;
+	begin_transaction();
+	purge_expired_bans(BAN_PURGE_BATCH);
+	commit();
+	flush();
+}
+
+// Main loop of a worker process, never returns
+static void run_worker(int64 channel, volatile uint64 *generation)
+{
+	writer_channel = channel;
+	session_seen_callback = send_session_seen;
+
+	if (db_attach("dietchan_db") < 0)
+		exit(1);
+	db_set_generation_counter(db, generation);
+
+	struct sigaction action;
+	byte_zero(&action, sizeof(action));
+	action.sa_sigaction = handle_render_fault;
+	action.sa_flags = SA_SIGINFO;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGSEGV, &action, 0);
+	sigaction(SIGBUS, &action, 0);
+
+	open_listeners();
+	io_nonblock(channel);
+	io_fd(channel);
+	io_wantread(channel);
+
+	while (1) {
+		io_waituntil2(-1);
+
+		int loop=1;
+		while (loop) {
+			loop = 0;
+			for (size_t i=0; i<listener_count; ++i)
+				accept_connections(listeners[i].socket, &listeners[i], 10000);
+
+			loop |= handle_read_events(100);
+			loop |= handle_write_events(10);
+		}
+	}
+}
+
+// Forks the worker processes. Must be called before anything is registered with io_wait, the
+// children would share the registrations.
+static int start_workers(unsigned long count)
+{
+	volatile uint64 *generation = mmap(0, sizeof(uint64), PROT_READ | PROT_WRITE,
+	                                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (generation == MAP_FAILED) {
+		perror("Could not create generation counter");
+		return -1;
+	}
+	db_set_generation_counter(db, generation);
+
+	for (unsigned long i=0; i<count; ++i) {
+		int pair[2];
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pair) == -1) {
+			perror("socketpair");
+			return -1;
+		}
+
+		pid_t pid = fork();
+		if (pid == -1) {
+			perror("fork");
+			close(pair[0]);
+			close(pair[1]);
+			return -1;
+		}
+		if (pid == 0) {
+			// Only the writer talks to the other workers
+			for (size_t j=0; j<worker_count; ++j)
+				close(workers[j].channel);
+			worker_count = 0;
+			close(pair[0]);
+			run_worker(pair[1], generation);
+		}
+
+		close(pair[1]);
+		workers[worker_count].channel = pair[0];
+		workers[worker_count].pid = pid;
+		++worker_count;
+	}
+
+	for (size_t i=0; i<worker_count; ++i) {
+		io_nonblock(workers[i].channel);
+		io_fd(workers[i].channel);
+		io_wantread(workers[i].channel);
+		io_setcookie(workers[i].channel, &workers[i]);
+	}
+	fprintf(stderr, "Started %d worker processes\n", (int)worker_count);
+	return 0;
+}
+
+static volatile sig_atomic_t print_stats = 0;
+
+static void handle_sigusr1(int sig)
+{
+	print_stats = 1;
+}
+
+static volatile sig_atomic_t start_snapshot = 0;
+
+static void handle_sigusr2(int sig)
+{
+	start_snapshot = 1;
 }
 
 const char *usage =
 	"Usage:\n"
 	"  dietchan [options]\n"
+	"  dietchan vacuum\n"
+	"  dietchan stats\n"
+	"  dietchan [options] replica <dir>\n"
+	"\n"
+	"Commands:\n"
+	"  vacuum     Compact the database file. The server must not be running.\n"
+	"  stats      Print allocator statistics. The server must not be running. A running\n"
+	"             server prints them when it receives SIGUSR1.\n"
+	"  replica    Serve a read-only copy of the database and keep applying the transactions\n"
+	"             that the primary archives in <dir>. Start with a snapshot of the primary's\n"
+	"             database. Requests that modify data are rejected.\n"
+	"\n"
+	"A running server writes a consistent copy of the database to " DB_SNAPSHOT_FILE "\n"
+	"when it receives SIGUSR2.\n"
 	"\n"
 	"Options:\n"
 	"  -l ip,port Listen on the specified ip address and port.\n"
+	"  -a dir     Archive every transaction in dir for replicas. Old segments of the\n"
+	"             archive are not removed automatically.\n"
+	"  -w count   Start count worker processes that render the pages which do not modify\n"
+	"             the database. Workers that exit are not replaced until the server is\n"
+	"             restarted. Cannot be used if dietchan is built with DB_UNDO_LOG.\n"
     "\n"
     "Examples:\n"
     "  dietchan -l 127.0.0.1,4000 -l ::1,4001\n"
@@ -321,13 +818,27 @@ int main(int argc, char* argv[])
 	setbuf(stderr, NULL);
 
 	signal(SIGPIPE, SIG_IGN);
+	signal(SIGUSR1, handle_sigusr1);
+	signal(SIGUSR2, handle_sigusr2);
 
 	// Parse options
 	int c;
 	struct ip ip;
 	uint16 port;
-	while ((c = getopt(argc, argv, "l:")) != -1) {
+	const char *archive_dir = 0;
+	const char *replica_dir = 0;
+	while ((c = getopt(argc, argv, "l:a:w:")) != -1) {
 		switch(c) {
+		case 'a':
+			archive_dir = optarg;
+			break;
+
+		case 'w':
+			if (optarg[scan_ulong(optarg, &worker_processes)] != '\0' ||
+			    worker_processes > MAX_WORKERS)
+				goto print_usage;
+			break;
+
 		case 'l':
 			if (!scan_ip(optarg, &ip))
 				goto print_usage;
@@ -360,6 +871,20 @@ int main(int argc, char* argv[])
 				return -1;
 			export();
 			return 0;
+		} else if (case_equals(argv[optind], "vacuum")) {
+			if (db_init("dietchan_db", 0) < 0)
+				return -1;
+			return vacuum();
+		} else if (case_equals(argv[optind], "stats")) {
+			if (db_init("dietchan_db", 0) < 0)
+				return -1;
+			db_print_stats(db);
+			return 0;
+		} else if (case_equals(argv[optind], "replica")) {
+			if (optind+1 >= argc || archive_dir)
+				goto print_usage;
+			replica_dir = argv[optind+1];
+			read_only = 1;
 		}
 	}
 
@@ -368,20 +893,83 @@ int main(int argc, char* argv[])
 		add_listener((struct ip){IP_V4, {127,0,0,1}}, 4000);
 
 
+	// A replica cannot start from an empty database, it would not share any history with the
+	// primary
+	struct stat st;
+	if (replica_dir && (stat("dietchan_db", &st) != 0 || st.st_size == 0)) {
+		fprintf(stderr, "Copy a snapshot of the primary's database to dietchan_db first.\n");
+		return -1;
+	}
+
+	// With the undo log, the writer changes the shared mapping in place for the whole round, so
+	// workers would have to wait for every write request
+	if (worker_processes && DB_UNDO_LOG) {
+		fprintf(stderr, "Worker processes cannot be used with the undo log\n");
+		return -1;
+	}
+
 	// Open database
 	if (db_init("dietchan_db", 1) < 0)
 		return -1;
 
+	db_set_group_commit(db, DB_GROUP_COMMIT);
+	// Workers read the database file, so the changes have to be copied there at every flush
+	db_set_wal(db, worker_processes?0:DB_WAL);
+	if (DB_WRITE_TRACKING)
+		db_set_write_tracking(db, 1);
+	if (DB_WARM_UP)
+		warm_up();
+	if (archive_dir && db_set_archive(db, archive_dir) != 0)
+		return -1;
+
 	// Create some required directories if they don't exist
 	mkdir(DOC_ROOT, 0755);
 	mkdir(DOC_ROOT "/uploads", 0755);
 	mkdir(DOC_ROOT "/captchas", 0755);
-	// Start generating captchas
-	generate_captchas();
+
+	if (worker_processes && start_workers(worker_processes) != 0)
+		return -1;
+	open_listeners();
+
+	// Start generating captchas. A replica gets them from the primary.
+	if (!read_only)
+		generate_captchas();
 
 	// Main loop
 	while (1) {
-		io_wait();
+		// If there are changes in the write-ahead log, wake up after a while to write them into
+		// the database file. While a snapshot is in progress, keep copying it between requests.
+		int64 timeout = db_snapshot_pending(db)?0:(checkpoint_pending()?DB_WAL_CHECKPOINT_IDLE:-1);
+		// A failed flush is tried again
+		if (db_flush_pending(db) && (timeout < 0 || timeout > DB_FLUSH_RETRY_INTERVAL))
+			timeout = DB_FLUSH_RETRY_INTERVAL;
+		// A replica looks for new transactions of the primary regularly
+		if (replica_dir && (timeout < 0 || timeout > DB_REPLICA_POLL_INTERVAL))
+			timeout = DB_REPLICA_POLL_INTERVAL;
+		// Wake up when the next ban expires
+		if (!read_only) {
+			int64 ban_timeout = ban_purge_timeout();
+			if (ban_timeout >= 0 && (timeout < 0 || timeout > ban_timeout))
+				timeout = ban_timeout;
+			// And when the last_seen times of the sessions are due
+			int64 session_timeout = session_flush_timeout();
+			if (session_timeout >= 0 && (timeout < 0 || timeout > session_timeout))
+				timeout = session_timeout;
+		}
+		int64 events = io_waituntil2(timeout);
+		if (events == 0 && checkpoint_pending())
+			checkpoint();
+
+		if (print_stats) {
+			print_stats = 0;
+			db_print_stats(db);
+		}
+
+		if (start_snapshot) {
+			start_snapshot = 0;
+			if (db_snapshot_begin(db, DB_SNAPSHOT_FILE) != 0)
+				fprintf(stderr, "A snapshot is already in progress\n");
+		}
 
 		int loop=1;
 		while (loop) {
@@ -394,7 +982,26 @@ int main(int argc, char* argv[])
 
 			loop |= handle_read_events(100);
 			loop |= handle_write_events(10);
+
+			// Write all transactions of this round to disk and send the held responses
+			flush();
 		}
+
+		if (!read_only) {
+			purge_bans();
+			session_flush_last_seen();
+		}
+
+		if (replica_dir) {
+			if (db_follow_archive(db, replica_dir) < 0) {
+				fprintf(stderr, "The replica cannot catch up with the primary. Copy a snapshot of the "
+				                "primary's database to restart it.\n");
+				return -1;
+			}
+			flush();
+		}
+
+		db_snapshot_step(db);
 	}
 
 	return 0;
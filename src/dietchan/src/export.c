@@ -23,6 +23,8 @@ void export()
 {
 	char buf[256];
 	printf("{\n");
+	// Lets the import size the post table in advance
+	printf("  \"post_count\": %" PRIu64 ",\n", post_tbl.data->number_of_elements);
 	printf("  \"boards\": [\n");
 	for (struct board *board=master_first_board(master); board; board=board_next_board(board)) {
 		printf("    {\n");
@@ -0,0 +1,69 @@
+#include "flood.h"
+
+#include "config.h"
+#include <libowfat/byte.h>
+
+// Open addressing with a bounded number of probes. Expired entries are free, if all probed entries
+// are in use, the one that expires first is replaced.
+#define FLOOD_PROBES 8
+
+struct flood_entry {
+	struct ip ip;
+	enum ban_target target;
+	uint64 until;
+};
+
+static struct flood_entry flood_table[FLOOD_TABLE_SIZE];
+
+static void flood_key(struct ip *key, struct ip *ip)
+{
+	byte_zero(key, sizeof(struct ip));
+	key->version = ip->version;
+	byte_copy(key->bytes, (ip->version == IP_V6)?8:4, ip->bytes);
+}
+
+static size_t flood_slot(struct ip *key, enum ban_target target)
+{
+	uint64 hash = target;
+	for (int i=0; i<16; ++i)
+		hash = hash*31 + key->bytes[i];
+	hash = hash*31 + key->version;
+	return (hash*0x9E3779B97F4A7C15ull) >> 32;
+}
+
+static struct flood_entry* flood_find(struct ip *key, enum ban_target target)
+{
+	size_t slot = flood_slot(key, target);
+	for (int i=0; i<FLOOD_PROBES; ++i) {
+		struct flood_entry *e = &flood_table[(slot+i) & (FLOOD_TABLE_SIZE-1)];
+		if (e->target == target && byte_equal(&e->ip, sizeof(struct ip), key))
+			return e;
+	}
+	return 0;
+}
+
+int64 flood_limited(struct ip *ip, enum ban_target target, uint64 now)
+{
+	struct ip key;
+	flood_key(&key, ip);
+	struct flood_entry *e = flood_find(&key, target);
+	return (e && e->until > now)?e->until:0;
+}
+
+void flood_limit(struct ip *ip, enum ban_target target, uint64 now, uint64 duration)
+{
+	struct ip key;
+	flood_key(&key, ip);
+	struct flood_entry *e = flood_find(&key, target);
+	if (!e) {
+		size_t slot = flood_slot(&key, target);
+		for (int i=0; i<FLOOD_PROBES; ++i) {
+			struct flood_entry *candidate = &flood_table[(slot+i) & (FLOOD_TABLE_SIZE-1)];
+			if (!e || candidate->until < e->until)
+				e = candidate;
+		}
+	}
+	e->ip = key;
+	e->target = target;
+	e->until = now + duration;
+}
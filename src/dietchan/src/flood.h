@@ -0,0 +1,15 @@
+#ifndef FLOOD_H
+#define FLOOD_H
+
+#include <libowfat/uint64.h>
+#include "persistence.h"
+
+// Flood limits of the clients. They are only kept in memory of the writer process and start over
+// when the server is restarted. IPv6 addresses are limited by their /64 prefix.
+
+// Time until which the address is limited for the target, 0 if it is not
+int64 flood_limited(struct ip *ip, enum ban_target target, uint64 now);
+// Limits the address for the target until now+duration
+void  flood_limit(struct ip *ip, enum ban_target target, uint64 now, uint64 duration);
+
+#endif // FLOOD_H
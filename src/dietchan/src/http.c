@@ -26,6 +26,38 @@ static void    http_free(context *ctx);
 static int     http_read(context *ctx, char *buf, int length);
 
 
+// Forgets everything that was parsed and written for the current request, so it can be parsed
+// again from the start. The connection and the collected request stay as they are.
+void http_reset(http_context *http)
+{
+	context_discard_output(&http->parent_instance);
+
+	if (http->finalize)
+		http->finalize(http);
+
+	array_reset(&http->read_buffer);
+	array_reset(&http->multipart_boundary);
+	array_reset(&http->multipart_real_boundary);
+	array_reset(&http->multipart_full_boundary);
+	array_reset(&http->multipart_name);
+	array_reset(&http->multipart_filename);
+	array_reset(&http->multipart_content_type);
+
+	struct ip ip = http->ip;
+	uint16 port = http->port;
+	array request_buffer = http->request_buffer;
+	int  (*request)(http_context *http, http_method method, char *path, char *query) = http->request;
+	void (*error)(http_context *http) = http->error;
+
+	byte_zero((char*)http + sizeof(context), sizeof(http_context) - sizeof(context));
+
+	http->ip = ip;
+	http->port = port;
+	http->request_buffer = request_buffer;
+	http->request = request;
+	http->error = error;
+}
+
 static ssize_t http_read_until_string(http_context *http, char *buf, size_t length, const char *str, size_t max_length);
 static ssize_t http_read_line(http_context *http, char *buf, size_t length, size_t max_length);
 static int     http_parse_header(http_context *http, char *line, size_t length);
@@ -83,6 +115,7 @@ void http_finalize(context *ctx)
 	array_reset(&http->multipart_name);
 	array_reset(&http->multipart_filename);
 	array_reset(&http->multipart_content_type);
+	array_reset(&http->request_buffer);
 }
 
 void http_free(context *ctx)
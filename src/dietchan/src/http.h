@@ -63,6 +63,9 @@ typedef struct http_context {
 	array multipart_filename;
 	array multipart_content_type;
 
+	// Worker processes collect the request here before parsing it, see worker_read_data()
+	array request_buffer;
+
 	// Data for callbacks
 	void *info;
 
@@ -83,6 +86,7 @@ typedef struct http_context {
 } http_context;
 
 http_context* http_new(int socket);
+void          http_reset(http_context *http);
 
 extern const http_error BAD_REQUEST;
 extern const http_error FORBIDDEN;
@@ -4,6 +4,7 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <stdio.h>
+#include <sys/stat.h>
 #include <libowfat/buffer.h>
 #include <libowfat/scan.h>
 #include <libowfat/textcode.h>
@@ -35,6 +36,12 @@ static array buf = {0};
 static size_t off=0;
 static int fd=0;
 
+// The post count of an export is only a hint for the size of the post table. Every post takes at
+// least this many bytes of the input, which bounds the hint by the size of the input.
+#define MIN_POST_BYTES         16
+// Bound of the hint if the size of the input is not known (e.g. a pipe)
+#define MAX_POST_COUNT_HINT    (1024*1024)
+
 
 void free_token(struct json_token *token)
 {
@@ -302,7 +309,7 @@ static int parse_post(struct thread *thread)
 			if (post_id(post) > post_counter)
 				post_counter = post_id(post);
 			master_set_post_counter(master, post_counter);
-			db_hashmap_insert(&post_tbl, &post_id(post), post);
+			db_u64map_insert(&post_tbl, post_id(post), post);
 		} else if (str_equal(token.string, "ip")) {
 			EXPECT2(TOK_STRING, &val);
 			struct ip ip = {0};
@@ -556,6 +563,17 @@ static int parse_user(void *unused)
 }
 
 
+static uint64 bound_post_count(int64 count)
+{
+	if (count <= 0)
+		return 0;
+	uint64 max = MAX_POST_COUNT_HINT;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+		max = st.st_size/MIN_POST_BYTES;
+	return ((uint64)count < max)?count:max;
+}
+
 int import()
 {
 	EXPECT(TOK_OBJ_BEGIN);
@@ -574,7 +592,10 @@ int import()
 		EXPECT(TOK_COLON);
 
 		struct json_token val = {0};
-		if (str_equal(token.string, "boards")) {
+		if (str_equal(token.string, "post_count")) {
+			EXPECT2(TOK_NUMBER, &val);
+			db_u64map_reserve(&post_tbl, post_tbl.data->number_of_elements + bound_post_count(val.number));
+		} else if (str_equal(token.string, "boards")) {
 			EXPECT(TOK_ARRAY_BEGIN);
 			if (parse_array(parse_board, 0) == -1)
 				return -1;
@@ -54,10 +54,7 @@ static void banned_page_ban_callback(struct ban *ban, struct ip *ip, void *extra
 {
 	http_context *http = extra;
 	struct banned_page *page = (struct banned_page*)http->info;
-	uint64 now = time(NULL);
-	if (ban_type(ban) == BAN_BLACKLIST &&
-	    ban_target(ban) == BAN_TARGET_POST &&
-	    ((ban_duration(ban) < 0) || (now <= ban_timestamp(ban) + ban_duration(ban)))) {
+	if (ban_type(ban) == BAN_BLACKLIST) {
 
 		uint64 *bids = ban_boards(ban);
 
@@ -101,15 +98,12 @@ static int banned_page_finish (http_context *http)
 	PRINT_BODY();
 
 
-	find_bans(&page->ip, banned_page_ban_callback, http);
-	if (page->x_real_ip.version)
-		find_bans(&page->x_real_ip, banned_page_ban_callback, http);
-
-	size_t count = array_length(&page->x_forwarded_for, sizeof(struct ip));
-	for (size_t i=0; i<count; ++i) {
-		struct ip *ip=array_get(&page->x_forwarded_for, sizeof(struct ip), i);
-		find_bans(ip, banned_page_ban_callback, http);
-	}
+	// The callback only sees bans that have not expired yet
+	struct ban_verdict verdict = {0};
+	verdict.callback = banned_page_ban_callback;
+	verdict.extra = http;
+	evaluate_bans(&verdict, &page->ip, &page->x_real_ip, &page->x_forwarded_for,
+	              0, BAN_TARGET_POST);
 
 	if (!page->any_ban) {
 		banned_page_print_header(http, _("Not banned"));
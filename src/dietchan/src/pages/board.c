@@ -159,9 +159,12 @@ static int  board_page_finish (http_context *http)
 
 	int post_render_flags = ismod?WRITE_POST_IP:0;
 
+	struct ban_verdict verdict = {0};
+	evaluate_bans(&verdict, &page->ip, &page->x_real_ip, &page->x_forwarded_for,
+	              board, BAN_TARGET_POST);
+
 	struct captcha *captcha = 0;
-	if (any_ip_affected(&page->ip, &page->x_real_ip, &page->x_forwarded_for,
-	                    board, BAN_TARGET_POST, is_captcha_required)) {
+	if (verdict.captcha) {
 		captcha = random_captcha();
 	}
 
@@ -182,6 +185,9 @@ static int  board_page_finish (http_context *http)
 	while (thread) {
 		if (i>=range_end)
 			break;
+		// The page is rendered again
+		if (read_outdated())
+			return 0;
 
 		if (i>=range_start) {
 			struct post* post = thread_first_post(thread);
@@ -202,6 +208,8 @@ static int  board_page_finish (http_context *http)
 				}
 				PRINT(S("<div class='replies'>"));
 				while (reply) {
+					if (read_outdated())
+						return 0;
 					print_post(http, reply, 1, post_render_flags);
 					reply = post_next_post(reply);
 				}
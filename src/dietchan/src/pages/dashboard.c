@@ -388,6 +388,11 @@ static int  dashboard_page_finish (http_context *http)
 		      S("<p><a class='button' href='"), S(PREFIX), S("/mod?action=ban&amp;redirect="), S(PREFIX), S("/dashboard'>" _("Add a ban") "</a></p>"));
 	}
 
+	if (user_type(page->user) == USER_ADMIN) {
+		PRINT(S("<h2>" _("Database") "</h2>"
+		        "<p><a class='button' href='"), S(PREFIX), S("/dashboard/stats'>" _("Statistics") "</a></p>"));
+	}
+
 	write_dashboard_footer(http);
 
 	PRINT_EOF();
@@ -67,7 +67,9 @@ static int  login_page_finish (http_context *http)
 	struct login_page *page = (struct login_page*)http->info;
 
 	if (page->logout) {
+		begin_transaction();
 		session_destroy(page->session);
+		commit();
 		page->session = 0;
 		page->user = 0;
 
@@ -124,14 +126,9 @@ static int  login_page_finish (http_context *http)
 	begin_transaction();
 
 	struct session *session = session_new();
-	struct session *next_session = master_first_session(master);
-	session_set_next_session(session, next_session);
-	if (next_session)
-		session_set_prev_session(next_session, session);
-	master_set_first_session(master, session);
 
 	uint64 timestamp = time(0);
-	char sid[33];
+	char sid[SESSION_SID_LENGTH+1];
 	generate_random_string(sid, sizeof(sid)-1, "0123456789abcdefghijklmnopqrstuvwxyz");
 	sid[sizeof(sid)-1] = '\0';
 
@@ -144,6 +141,8 @@ static int  login_page_finish (http_context *http)
 	session_set_last_ip(session, page->ip);
 	session_set_sid(session, sid);
 
+	insert_session(session);
+
 	commit();
 
 	// Todo: Expire old session
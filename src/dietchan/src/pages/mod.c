@@ -16,6 +16,7 @@
 #include "../tpl.h"
 #include "../util.h"
 #include "../permissions.h"
+#include "../flood.h"
 
 #include "../locale.h"
 
@@ -417,6 +418,15 @@ static int  mod_page_finish (http_context *http)
 		do_it = 0;
 	}
 
+	if (do_report && do_it) {
+		uint64 now = time(NULL);
+		int64 flood = flood_limited(&http->ip, BAN_TARGET_REPORT, now);
+		if (flood) {
+			PRINT(S("<p class='error'>" _("Flood Protection: You may retry in") " "), U64(flood - now), S(" " _("seconds") ".</p>"));
+			do_it = 0;
+		}
+	}
+
 	// ---------------------------------------------------------------------------------------------
 
 	if (do_it)
@@ -493,6 +503,8 @@ static int  mod_page_finish (http_context *http)
 				uint64 ban_counter = master_ban_counter(master) +1;
 				master_set_ban_counter(master, ban_counter);
 				ban_set_id(ban, ban_counter);
+			} else {
+				begin_update_ban(ban);
 			}
 			ban_set_enabled(ban,    page->enabled);
 
@@ -679,13 +691,7 @@ static int  mod_page_finish (http_context *http)
 
 						report_set_timestamp(report, timestamp);
 
-						struct report *prev = master_last_report(master);
-						report_set_prev_report(report, prev);
-						if (prev)
-							report_set_next_report(prev, report);
-						else
-							master_set_first_report(master, report);
-						master_set_last_report(master, report);
+						insert_report(report);
 					}
 				}
 				if (do_delete) {
@@ -705,6 +711,9 @@ static int  mod_page_finish (http_context *http)
 		}
 	}
 
+	if (do_report && do_it)
+		flood_limit(&http->ip, BAN_TARGET_REPORT, timestamp, REPORT_FLOOD_LIMIT);
+
 	// Remove reports
 	if (do_delete_report && do_it) {
 		size_t length = array_length(&page->reports, sizeof(uint64));
@@ -31,6 +31,7 @@
 #include "../util.h"
 #include "../captcha.h"
 #include "../bans.h"
+#include "../flood.h"
 #include "../permissions.h"
 
 
@@ -397,10 +398,11 @@ static int post_page_finish (http_context *http)
 
 	// Check if user is banned
 
-	int64 banned = any_ip_affected(&page->ip, &page->x_real_ip, &page->x_forwarded_for,
-	                               board, BAN_TARGET_POST, is_banned);
+	struct ban_verdict verdict = {0};
+	evaluate_bans(&verdict, &page->ip, &page->x_real_ip, &page->x_forwarded_for,
+	              board, BAN_TARGET_POST);
 
-	if (banned) {
+	if (verdict.banned) {
 		PRINT_REDIRECT("302 Found",
 		               S(PREFIX), S("/banned"));
 		return ERROR;
@@ -458,21 +460,20 @@ static int post_page_finish (http_context *http)
 
 	// Check if user is flood-limited
 
-	int64 flood = any_ip_affected(&page->ip, &page->x_real_ip, &page->x_forwarded_for,
-	                              board, BAN_TARGET_POST, is_flood_limited);
+	int64 flood = flood_limited(&page->ip, BAN_TARGET_POST, verdict.now);
+	if (!flood)
+		flood = verdict.flood;
 
 	if (flood) {
-		uint64 now = time(0);
 		PRINT_STATUS_HTML("403 " _("Forbidden") "");
 		PRINT_BODY();
-		PRINT(S("<p>" _("Flood Protection: You may retry in") " "), U64(flood - now), S(" " _("seconds") ".</p>"));
+		PRINT(S("<p>" _("Flood Protection: You may retry in") " "), U64(flood - verdict.now), S(" " _("seconds") ".</p>"));
 		PRINT_EOF();
 		return ERROR;
 	}
 
 	// Check captcha
-	if (any_ip_affected(&page->ip, &page->x_real_ip, &page->x_forwarded_for,
-	                    board, BAN_TARGET_POST, is_captcha_required)) {
+	if (verdict.captcha) {
 		if (!page->captcha || str_equal(page->captcha, "")) {
 			PRINT_STATUS_HTML("403 " _("Forbidden") "");
 			PRINT_BODY();
@@ -560,7 +561,7 @@ static int post_page_finish (http_context *http)
 
 	post_set_id(post, master_post_counter(master)+1);
 	master_set_post_counter(master, post_id(post));
-	db_hashmap_insert(&post_tbl, &post_id(post), post);
+	db_u64map_insert(&post_tbl, post_id(post), post);
 
 	uint64 timestamp = time(NULL);
 
@@ -659,24 +660,7 @@ static int post_page_finish (http_context *http)
 		}
 	}
 
-	purge_expired_bans();
-
-	struct ban *ban = ban_new();
-	uint64 ban_counter = master_ban_counter(master)+1;
-	master_set_ban_counter(master, ban_counter);
-	ban_set_id(ban, ban_counter);
-	ban_set_enabled(ban, 1);
-	ban_set_type(ban, BAN_FLOOD);
-	ban_set_target(ban, BAN_TARGET_POST);
-	ban_set_timestamp(ban, timestamp);
-	ban_set_duration(ban, FLOOD_LIMIT);
-	struct ip_range range;
-	range.ip = page->ip;
-	range.range = 32; // FIXME: support IPV6
-	ban_set_range(ban, range);
-	ban_set_post(ban, post_id(post));
-
-	insert_ban(ban);
+	flood_limit(&page->ip, BAN_TARGET_POST, timestamp, FLOOD_LIMIT);
 
 	commit();
 
@@ -0,0 +1,154 @@
+#include "stats.h"
+
+#include <libowfat/byte.h>
+#include <libowfat/fmt.h>
+#include <assert.h>
+
+#include "../tpl.h"
+#include "../util.h"
+#include "../print.h"
+#include "dashboard.h"
+
+#include "../locale.h"
+
+static int  stats_page_param (http_context *http, char *key, char *val);
+static int  stats_page_cookie (http_context *http, char *key, char *val);
+static int  stats_page_finish (http_context *http);
+static void stats_page_finalize(http_context *http);
+
+void stats_page_init(http_context *http)
+{
+	struct stats_page *page = malloc(sizeof(struct stats_page));
+	byte_zero(page, sizeof(struct stats_page));
+	http->info = page;
+
+	http->get_param    = stats_page_param;
+	http->post_param   = stats_page_param;
+	http->cookie       = stats_page_cookie;
+	http->finish       = stats_page_finish;
+	http->finalize     = stats_page_finalize;
+}
+
+static int  stats_page_param (http_context *http, char *key, char *val)
+{
+	struct stats_page *page = (struct stats_page*)http->info;
+
+	PARAM_STR("action", page->action);
+
+	HTTP_FAIL(BAD_REQUEST);
+}
+
+static int  stats_page_cookie (http_context *http, char *key, char *val)
+{
+	struct stats_page *page = (struct stats_page*)http->info;
+	PARAM_SESSION();
+	return 0;
+}
+
+#define STATS_ROW(label, value) S("<tr><th>" label "</th><td>"), value, S("</td></tr>")
+
+static int  stats_page_finish (http_context *http)
+{
+	struct stats_page *page = (struct stats_page*)http->info;
+
+	// Check permission
+
+	if (!page->user || user_type(page->user) != USER_ADMIN) {
+		PRINT_STATUS_HTML("403 " _("Forbidden"));
+		PRINT_SESSION();
+		PRINT_BODY();
+		PRINT(S("<h1>403 " _("Forbidden") "</h1>"
+		        _("You shall not pass")));
+		PRINT_EOF();
+		return 0;
+	}
+
+	int snapshot_started = 0;
+	if (page->action && case_equals(page->action, "snapshot"))
+		snapshot_started = (db_snapshot_begin(db, DB_SNAPSHOT_FILE) == 0);
+
+	db_stats stats;
+	db_get_stats(db, &stats);
+
+	PRINT_STATUS_HTML("200 OK");
+	PRINT_SESSION();
+	PRINT_BODY();
+
+	write_dashboard_header(http, user_id(page->user));
+
+	PRINT(S("<h2>" _("Database") "</h2>"
+	        "<p><table>"),
+	      STATS_ROW(_("File size"),          U64(stats.file_size)),
+	      STATS_ROW(_("Allocated"),          U64(stats.allocated_bytes)),
+	      STATS_ROW(_("Free"),               U64(stats.free_bytes)),
+	      STATS_ROW(_("Largest free block"), U64(stats.largest_free_block)),
+	      S("</table></p>"));
+
+	if (db_snapshot_pending(db)) {
+		PRINT(S("<p>"), snapshot_started?S(_("Snapshot started")):S(_("A snapshot is in progress")),
+		      S(". " _("It will be written to") " <code>" DB_SNAPSHOT_FILE "</code>.</p>"));
+	} else {
+		PRINT(S("<form method='post'>"
+		          "<input type='hidden' name='action' value='snapshot'>"
+		          "<p><input type='submit' value='" _("Create snapshot") "'></p>"
+		        "</form>"));
+	}
+
+	PRINT(S("<h3>" _("Free lists") "</h3>"
+	        "<p><table>"
+	          "<tr><th>" _("Block size") "</th><th>" _("Blocks") "</th></tr>"));
+	for (int i=0; i<BUCKET_COUNT; ++i) {
+		if (!stats.free_buckets[i])
+			continue;
+		PRINT(S("<tr><td>"), U64(MIN_BUCKET_SIZE << i), S("</td><td>"), U64(stats.free_buckets[i]), S("</td></tr>"));
+	}
+	PRINT(S("</table></p>"));
+
+	PRINT(S("<h3>" _("Slabs") "</h3>"
+	        "<p><table>"
+	          "<tr><th>" _("Slot size") "</th><th>" _("Partially used pages") "</th><th>" _("Free slots") "</th></tr>"));
+	for (int i=0; i<DB_SLAB_CLASS_COUNT; ++i) {
+		if (!stats.slab_partial_pages[i])
+			continue;
+		PRINT(S("<tr><td>"), U64(16*(i+1)), S("</td><td>"), U64(stats.slab_partial_pages[i]),
+		      S("</td><td>"), U64(stats.slab_free_slots[i]), S("</td></tr>"));
+	}
+	PRINT(S("</table></p>"));
+
+	PRINT(S("<h3>" _("Since the server was started") "</h3>"
+	        "<p><table>"),
+	      STATS_ROW(_("Bytes requested"), U64(stats.bytes_requested)),
+	      STATS_ROW(_("Bytes allocated"), U64(stats.bytes_allocated)),
+	      STATS_ROW(_("Transactions"),    U64(stats.transactions)),
+	      STATS_ROW(_("Journal writes"),  U64(stats.flushes)),
+	      STATS_ROW(_("Journal bytes"),   U64(stats.journal_bytes)));
+	if (stats.flushes) {
+		PRINT(STATS_ROW(_("Bytes per journal write"),         U64(stats.journal_bytes/stats.flushes)),
+		      STATS_ROW(_("Average write latency") " (µs)", U64(stats.flush_time/stats.flushes)),
+		      STATS_ROW(_("Maximum write latency") " (µs)", U64(stats.max_flush_time)));
+	}
+	PRINT(S("</table></p>"));
+
+	PRINT(S("<h3>" _("Regions per commit") "</h3>"
+	        "<p><table>"
+	          "<tr><th>" _("Regions") "</th><th>" _("Commits") "</th></tr>"));
+	for (int i=0; i<DB_HISTOGRAM_SIZE; ++i) {
+		if (!stats.commit_histogram[i])
+			continue;
+		PRINT(S("<tr><td>"), U64((1ULL << i) & ~1ULL), S(" – "), U64((1ULL << (i+1)) - 1),
+		      S("</td><td>"), U64(stats.commit_histogram[i]), S("</td></tr>"));
+	}
+	PRINT(S("</table></p>"));
+
+	write_dashboard_footer(http);
+
+	PRINT_EOF();
+	return 0;
+}
+
+static void stats_page_finalize(http_context *http)
+{
+	struct stats_page *page = (struct stats_page*)http->info;
+	if (page->action) free(page->action);
+	free(page);
+}
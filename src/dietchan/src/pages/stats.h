@@ -0,0 +1,16 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "../config.h"
+#include "../http.h"
+#include "../persistence.h"
+
+struct stats_page {
+	struct session *session;
+	struct user *user;
+	char *action;
+};
+
+void stats_page_init(http_context *http);
+
+#endif // STATS_H
@@ -173,9 +173,12 @@ static int thread_page_finish (http_context *http)
 	PRINT(S("<h1>/"),E(board_name(board)),S("/ – "),E(board_title(board)),S("</h1>"
 	      "<hr>"));
 
+	struct ban_verdict verdict = {0};
+	evaluate_bans(&verdict, &page->ip, &page->x_real_ip, &page->x_forwarded_for,
+	              board, BAN_TARGET_POST);
+
 	struct captcha *captcha = 0;
-	if (any_ip_affected(&page->ip, &page->x_real_ip, &page->x_forwarded_for,
-	                    board, BAN_TARGET_POST, is_captcha_required)) {
+	if (verdict.captcha) {
 		captcha = random_captcha();
 	}
 
@@ -193,6 +196,9 @@ static int thread_page_finish (http_context *http)
 	post = post_next_post(post);
 
 	while (post) {
+		// The page is rendered again
+		if (read_outdated())
+			return 0;
 		print_post(http, post, 0, post_render_flags);
 
 		post = post_next_post(post);
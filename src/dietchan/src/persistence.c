@@ -1,5 +1,7 @@
 #include "persistence.h"
 
+#include <stdio.h>
+#include <stddef.h>
 #include <time.h>
 #include <string.h>
 #include <unistd.h>
@@ -8,22 +10,33 @@
 #include <libowfat/case.h>
 #include "util.h"
 #include "config.h"
+#include "context.h"
 
 #include "locale.h"
 
 db_obj *db;
+int read_only;
 struct master *master;
-db_hashmap post_tbl;
-db_hashmap ban_tbl;
-db_hashmap captcha_tbl;
-
-
-static void insert_ban_into_hashmap(struct ban *ban);
-static void delete_ban_from_hashmap(struct ban *ban);
+db_u64map  post_tbl;
+db_u64map  captcha_tbl;
+db_btree   ban_expiry_idx;
+db_btree   report_board_idx;
+db_iptrie  ban_trie;
+db_hashmap session_tbl;
+
+
+static void load_tables();
+static void upgrade();
+static void insert_ban_into_trie(struct ban *ban);
+static void delete_ban_from_trie(struct ban *ban);
+static void insert_ban_into_index(struct ban *ban);
+static void delete_ban_from_index(struct ban *ban);
+static uint64 sid_hash(void *key, void *extra);
+static int sid_eq(void *a, void *b, void *extra);
 
 int db_init(const char *file, int create_default)
 {
-	db = db_open(file);
+	db = db_open_mode(file, DB_UNDO_LOG?DB_OPEN_UNDO_LOG:0);
 	if (!db)
 		return -1;
 	master = db_get_master_ptr(db);
@@ -34,15 +47,24 @@ int db_init(const char *file, int create_default)
 		memset(master, 0, sizeof(master));
 		db_invalidate(db, master);
 		db_set_master_ptr(db, master);
+		master_set_version(master, DB_VERSION);
+
+		db_u64map_init(&post_tbl, db, 0);
+		master_set_post_tbl(master, db_u64map_marshal(&post_tbl));
+
+		db_iptrie_init(&ban_trie, db, 0);
+		master_set_ban_trie(master, db_iptrie_marshal(&ban_trie));
 
-		db_hashmap_init(&post_tbl, db, 0, uint64_hash, 0, uint64_eq, 0);
-		master_set_post_tbl(master, db_hashmap_marshal(&post_tbl));
+		db_u64map_init(&captcha_tbl, db, 0);
+		master_set_captcha_tbl(master, db_u64map_marshal(&captcha_tbl));
 
-		db_hashmap_init(&ban_tbl, db, 0, ip_range_hash, 0, ip_range_eq, 0);
-		master_set_ban_tbl(master, db_hashmap_marshal(&ban_tbl));
+		db_btree_init(&ban_expiry_idx, db, 0);
+		master_set_ban_expiry_idx(master, db_btree_marshal(&ban_expiry_idx));
+		db_btree_init(&report_board_idx, db, 0);
+		master_set_report_board_idx(master, db_btree_marshal(&report_board_idx));
 
-		db_hashmap_init(&captcha_tbl, db, 0, uint64_hash, 0, uint64_eq, 0);
-		master_set_captcha_tbl(master, db_hashmap_marshal(&captcha_tbl));
+		db_hashmap_init(&session_tbl, db, 0, sid_hash, 0, sid_eq, 0);
+		master_set_session_tbl(master, db_hashmap_marshal(&session_tbl));
 
 		if (create_default) {
 			struct board *board = board_new();
@@ -68,13 +90,140 @@ int db_init(const char *file, int create_default)
 
 		commit();
 	} else {
-		db_hashmap_init(&post_tbl, db, db_unmarshal(db, master_post_tbl(master)), uint64_hash, 0, uint64_eq, 0);
-		db_hashmap_init(&ban_tbl, db, db_unmarshal(db, master_ban_tbl(master)), ip_range_hash, 0, ip_range_eq, 0);
-		db_hashmap_init(&captcha_tbl, db, db_unmarshal(db, master_captcha_tbl(master)), uint64_hash, 0, uint64_eq, 0);
+		upgrade();
+		load_tables();
+	}
+	return 0;
+}
+
+int db_attach(const char *file)
+{
+	db = db_open_mode(file, DB_OPEN_READ_ONLY);
+	if (!db)
+		return -1;
+	master = db_get_master_ptr(db);
+	if (!master) {
+		fprintf(stderr, "Could not open database: It has not been initialized\n");
+		return -1;
 	}
+	load_tables();
+	read_only = 1;
 	return 0;
 }
 
+static void load_tables()
+{
+	db_u64map_init(&post_tbl, db, db_unmarshal(db, master_post_tbl(master)));
+	db_iptrie_init(&ban_trie, db, db_unmarshal(db, master_ban_trie(master)));
+	db_u64map_init(&captcha_tbl, db, db_unmarshal(db, master_captcha_tbl(master)));
+	db_btree_init(&ban_expiry_idx, db, db_unmarshal(db, master_ban_expiry_idx(master)));
+	db_btree_init(&report_board_idx, db, db_unmarshal(db, master_report_board_idx(master)));
+	db_hashmap_init(&session_tbl, db, db_unmarshal(db, master_session_tbl(master)), sid_hash, 0, sid_eq, 0);
+}
+
+// Grows the master object to the current size. Fields after old_size are cleared.
+static void extend_master(size_t old_size)
+{
+	master = db_realloc(db, master, sizeof(struct master));
+	byte_zero((char*)master + old_size, sizeof(struct master) - old_size);
+	db_invalidate_region(db, (char*)master + old_size, sizeof(struct master) - old_size);
+	db_set_master_ptr(db, master);
+}
+
+// Converts a database written by an older version
+static void upgrade()
+{
+	if (master_version(master) >= DB_VERSION)
+		return;
+
+	begin_transaction();
+
+	uint64 version = master_version(master);
+
+	// Posts and captchas used to be in generic hash tables
+	db_hashmap old_post_tbl;
+	db_hashmap old_captcha_tbl;
+	if (version < 2) {
+		db_hashmap_init(&old_post_tbl, db, db_unmarshal(db, master_post_tbl(master)), uint64_hash, 0, uint64_eq, 0);
+		db_hashmap_init(&old_captcha_tbl, db, db_unmarshal(db, master_captcha_tbl(master)), uint64_hash, 0, uint64_eq, 0);
+	}
+
+	if (version < 1) {
+		db_hashmap_upgrade(&old_post_tbl);
+		db_hashmap_upgrade(&old_captcha_tbl);
+	}
+
+	if (version < 2) {
+		db_u64map_init(&post_tbl, db, 0);
+		db_u64map_reserve(&post_tbl, old_post_tbl.data->number_of_elements);
+		for (struct board *board=master_first_board(master); board; board=board_next_board(board))
+			for (struct thread *thread=board_first_thread(board); thread; thread=thread_next_thread(thread))
+				for (struct post *post=thread_first_post(thread); post; post=post_next_post(post))
+					db_u64map_insert(&post_tbl, post_id(post), post);
+		master_set_post_tbl(master, db_u64map_marshal(&post_tbl));
+		db_hashmap_free(&old_post_tbl);
+
+		db_u64map_init(&captcha_tbl, db, 0);
+		db_u64map_reserve(&captcha_tbl, master_captcha_count(master));
+		uint64 *captchas = master_captchas(master);
+		for (uint64 i=0; i<master_captcha_count(master); ++i)
+			db_u64map_insert(&captcha_tbl, captchas[i], db_hashmap_get(&old_captcha_tbl, &captchas[i]));
+		master_set_captcha_tbl(master, db_u64map_marshal(&captcha_tbl));
+		db_hashmap_free(&old_captcha_tbl);
+	}
+
+	// The tables used to record only the size of a resize in progress that grows them
+	if (version == 2) {
+		db_u64map_init(&post_tbl, db, db_unmarshal(db, master_post_tbl(master)));
+		db_u64map_upgrade_data(&post_tbl);
+		master_set_post_tbl(master, db_u64map_marshal(&post_tbl));
+		db_u64map_init(&captcha_tbl, db, db_unmarshal(db, master_captcha_tbl(master)));
+		db_u64map_upgrade_data(&captcha_tbl);
+		master_set_captcha_tbl(master, db_u64map_marshal(&captcha_tbl));
+	}
+
+	if (version < 4) {
+		extend_master(offsetof(struct master, ban_expiry_idx));
+
+		db_btree_init(&ban_expiry_idx, db, 0);
+		for (struct ban *ban=master_first_ban(master); ban; ban=ban_next_ban(ban))
+			insert_ban_into_index(ban);
+		master_set_ban_expiry_idx(master, db_btree_marshal(&ban_expiry_idx));
+
+		db_btree_init(&report_board_idx, db, 0);
+		for (struct report *report=master_first_report(master); report; report=report_next_report(report))
+			db_btree_insert(&report_board_idx, report_board_id(report), report_id(report), report);
+		master_set_report_board_idx(master, db_btree_marshal(&report_board_idx));
+	}
+
+	if (version < 5) {
+		// Bans used to be looked up in a hash table, once for every prefix length
+		extend_master(offsetof(struct master, ban_trie));
+		db_iptrie_init(&ban_trie, db, 0);
+		for (struct ban *ban=master_first_ban(master); ban; ban=ban_next_ban(ban))
+			insert_ban_into_trie(ban);
+		master_set_ban_trie(master, db_iptrie_marshal(&ban_trie));
+
+		db_hashmap old_ban_tbl;
+		db_hashmap_init(&old_ban_tbl, db, db_unmarshal(db, master_ban_tbl(master)), ip_range_hash, 0, ip_range_eq, 0);
+		if (version < 1)
+			db_hashmap_upgrade(&old_ban_tbl);
+		db_hashmap_free(&old_ban_tbl);
+		master_set_ban_tbl(master, 0);
+	}
+
+	if (version < 6) {
+		extend_master(offsetof(struct master, session_tbl));
+		db_hashmap_init(&session_tbl, db, 0, sid_hash, 0, sid_eq, 0);
+		for (struct session *session=master_first_session(master); session; session=session_next_session(session))
+			db_hashmap_insert(&session_tbl, session_sid(session), session);
+		master_set_session_tbl(master, db_hashmap_marshal(&session_tbl));
+	}
+
+	master_set_version(master, DB_VERSION);
+	commit();
+}
+
 char* db_strdup(const char *s)
 {
 	size_t length = strlen(s)+1;
@@ -102,6 +251,105 @@ void begin_transaction()
 void commit()
 {
 	db_commit(db);
+
+	// With group commit, the transaction is not on disk yet. Hold back all responses until the
+	// next flush, so that no client ever sees data that could still be lost in a crash.
+	if (db_flush_pending(db))
+		context_hold_output();
+}
+
+void flush()
+{
+	// Responses stay held until their transactions are on disk. A failed flush is tried again
+	// in the next round of the main loop, see DB_FLUSH_RETRY_INTERVAL.
+	if (db_flush(db) != 0)
+		return;
+	context_release_output();
+
+	if (db_journal_size(db) >= DB_WAL_CHECKPOINT_SIZE)
+		checkpoint();
+}
+
+static uint64 read_generation;
+static int    reading;
+
+void read_begin()
+{
+	read_generation = db_read_begin(db);
+	reading = 1;
+}
+
+void read_end()
+{
+	reading = 0;
+}
+
+int read_outdated()
+{
+	return reading && db_read_retry(db, read_generation);
+}
+
+int checkpoint_pending()
+{
+	return db_journal_size(db) > 0;
+}
+
+void checkpoint()
+{
+	db_checkpoint(db);
+}
+
+static volatile char warm_up_sink;
+
+static void warm_up_str(const char *s)
+{
+	if (s)
+		warm_up_sink += str_len(s);
+}
+
+static void warm_up_post(struct post *post)
+{
+	warm_up_str(post_subject(post));
+	warm_up_str(post_username(post));
+	warm_up_str(post_text(post));
+	for (struct upload *upload = post_first_upload(post); upload; upload = upload_next_upload(upload)) {
+		warm_up_str(upload_file(upload));
+		warm_up_str(upload_thumbnail(upload));
+	}
+}
+
+// Reads everything needed for the first pages of every board, so the first requests after a
+// restart do not stall on page faults. The rest of the database is read ahead in the background.
+void warm_up()
+{
+	db_prefault(db);
+
+	uint64 posts = 0;
+	for (struct board *board = master_first_board(master); board; board = board_next_board(board)) {
+		warm_up_str(board_name(board));
+		warm_up_str(board_title(board));
+
+		int64 i = 0;
+		struct thread *thread = board_first_thread(board);
+		while (thread && i < DB_WARM_UP_PAGES*THREADS_PER_PAGE) {
+			struct post *post = thread_first_post(thread);
+			warm_up_post(post);
+			++posts;
+
+			// Same replies as in the board view
+			struct post *reply = thread_last_post(thread);
+			for (int k=0; k<PREVIEW_REPLIES && reply && reply != post; ++k) {
+				warm_up_post(reply);
+				++posts;
+				reply = post_prev_post(reply);
+			}
+
+			thread = thread_next_thread(thread);
+			++i;
+		}
+	}
+
+	printf("Warm-up: read %llu posts\n", (unsigned long long)posts);
 }
 
 struct board* find_board_by_name(const char *name)
@@ -145,13 +393,9 @@ void delete_board(struct board *board)
 		thread = next;
 	}
 	// Delete all reports belonging to this board
-	struct report *report = master_first_report(master);
-	while (report) {
-		struct report *next_report = report_next_report(report);
-		if (report_board_id(report) && board_id(board))
-			delete_report(report);
-		report = next_report;
-	}
+	db_btree_iter it;
+	while (db_btree_seek(&report_board_idx, &it, board_id(board)) && it.key == board_id(board))
+		delete_report(it.val);
 	// Remove board from linked list & free
 	struct board *prev = board_prev_board(board);
 	struct board *next = board_next_board(board);
@@ -274,8 +518,23 @@ void report_free(struct report *o)
 	db_free(db, db_unmarshal(db, o->comment));
 }
 
+void insert_report(struct report *report)
+{
+	struct report *prev = master_last_report(master);
+	report_set_prev_report(report, prev);
+	if (prev)
+		report_set_next_report(prev, report);
+	else
+		master_set_first_report(master, report);
+	master_set_last_report(master, report);
+
+	db_btree_insert(&report_board_idx, report_board_id(report), report_id(report), report);
+}
+
 void delete_report(struct report *report)
 {
+	db_btree_remove(&report_board_idx, report_board_id(report), report_id(report));
+
 	struct report *next = report_next_report(report);
 	struct report *prev = report_prev_report(report);
 
@@ -316,14 +575,14 @@ void post_free(struct post *o)
 
 struct post* find_post_by_id(uint64 id)
 {
-	return db_hashmap_get(&post_tbl, &id);
+	return db_u64map_get(&post_tbl, id);
 }
 
 void delete_post(struct post *post)
 {
 	struct thread *thread = post_thread(post);
 
-	db_hashmap_remove(&post_tbl, &post_id(post));
+	db_u64map_remove(&post_tbl, post_id(post));
 
 	struct upload *upload = post_first_upload(post);
 	while (upload) {
@@ -405,18 +664,21 @@ void session_free(struct session *o)
 
 struct session *find_session_by_sid(const char *sid)
 {
-	// Dumb linear search
-	struct session *session = master_first_session(master);
-	while (session) {
-		const char *s = session_sid(session);
-		if (str_equal(s, sid))
-			return session;
-		session = session_next_session(session);
-	}
-	return 0;
+	return db_hashmap_get(&session_tbl, (void*)sid);
 }
 
-void session_destroy(struct session *session)
+void insert_session(struct session *session)
+{
+	struct session *next_session = master_first_session(master);
+	session_set_next_session(session, next_session);
+	if (next_session)
+		session_set_prev_session(next_session, session);
+	master_set_first_session(master, session);
+
+	db_hashmap_insert(&session_tbl, session_sid(session), session);
+}
+
+void delete_session(struct session *session)
 {
 	if (!session)
 		return;
@@ -429,9 +691,24 @@ void session_destroy(struct session *session)
 	if (prev_session)
 		session_set_next_session(prev_session, next_session);
 
+	db_hashmap_remove(&session_tbl, session_sid(session));
+
 	session_free(session);
 }
 
+static uint64 sid_hash(void *key, void *extra)
+{
+	uint64 hash = 0;
+	for (const char *c = (const char*)key; *c; ++c)
+		hash = hash*31 + (unsigned char)*c;
+	return hash;
+}
+
+static int sid_eq(void *a, void *b, void *extra)
+{
+	return str_equal((const char*)a, (const char*)b);
+}
+
 
 void ban_free(struct ban *ban)
 {
@@ -442,35 +719,48 @@ void ban_free(struct ban *ban)
 }
 
 
-static void insert_ban_into_hashmap(struct ban *ban)
+// The trie refers to the first of the bans with the same range, the others are linked to it
+static void insert_ban_into_trie(struct ban *ban)
 {
-	struct ban *item = db_hashmap_get(&ban_tbl, &ban_range(ban));
-	if (item) {
-		db_hashmap_remove(&ban_tbl, &ban_range(item));
+	struct ban *item = db_iptrie_get(&ban_trie, &ban_range(ban));
+	if (item)
 		ban_set_prev_in_bucket(item, ban);
-		ban_set_next_in_bucket(ban, item);
-	}
-	db_hashmap_insert(&ban_tbl, &ban_range(ban), ban);
-
+	ban_set_prev_in_bucket(ban, 0);
+	ban_set_next_in_bucket(ban, item);
+	db_iptrie_insert(&ban_trie, &ban_range(ban), ban);
 }
 
-static void delete_ban_from_hashmap(struct ban *ban)
+static void delete_ban_from_trie(struct ban *ban)
 {
-	// Remove from hashmap
 	struct ban *prev = ban_prev_in_bucket(ban);
 	struct ban *next = ban_next_in_bucket(ban);
 	if (prev)
 		ban_set_next_in_bucket(prev, next);
 	if (next)
 		ban_set_prev_in_bucket(next, prev);
+	if (prev)
+		return;
 
-	if (db_hashmap_get(&ban_tbl, &ban_range(ban)) == ban) {
-		db_hashmap_remove(&ban_tbl, &ban_range(ban));
-		if (next)
-			db_hashmap_insert(&ban_tbl, &ban_range(next), next);
+	if (next) {
+		db_iptrie_insert(&ban_trie, &ban_range(ban), next);
+	} else {
+		db_iptrie_remove(&ban_trie, &ban_range(ban));
 	}
 }
 
+static void insert_ban_into_index(struct ban *ban)
+{
+	// Permanent bans are not indexed
+	if (ban_duration(ban) >= 0)
+		db_btree_insert(&ban_expiry_idx, ban_timestamp(ban) + ban_duration(ban), ban_id(ban), ban);
+}
+
+static void delete_ban_from_index(struct ban *ban)
+{
+	if (ban_duration(ban) >= 0)
+		db_btree_remove(&ban_expiry_idx, ban_timestamp(ban) + ban_duration(ban), ban_id(ban));
+}
+
 void insert_ban(struct ban *ban)
 {
 	// Insert into linked list
@@ -482,19 +772,26 @@ void insert_ban(struct ban *ban)
 		master_set_first_ban(master, ban);
 	master_set_last_ban(master, ban);
 
-	// Insert into hashmap
-	insert_ban_into_hashmap(ban);
+	insert_ban_into_trie(ban);
+	insert_ban_into_index(ban);
+}
+
+void begin_update_ban(struct ban *ban)
+{
+	delete_ban_from_trie(ban);
+	delete_ban_from_index(ban);
 }
 
 void update_ban(struct ban *ban)
 {
-	delete_ban_from_hashmap(ban);
-	insert_ban_into_hashmap(ban);
+	insert_ban_into_trie(ban);
+	insert_ban_into_index(ban);
 }
 
 void delete_ban(struct ban *ban)
 {
-	delete_ban_from_hashmap(ban);
+	delete_ban_from_trie(ban);
+	delete_ban_from_index(ban);
 
 	// Remove from linked list
 	struct ban *prev = ban_prev_ban(ban);
@@ -528,5 +825,5 @@ void captcha_free(struct captcha *captcha)
 
 struct captcha* find_captcha_by_id(uint64 id)
 {
-	return db_hashmap_get(&captcha_tbl, &id);
+	return db_u64map_get(&captcha_tbl, id);
 }
@@ -5,19 +5,39 @@
 
 #include "db.h"
 #include "db_hashmap.h"
+#include "db_u64map.h"
+#include "db_btree.h"
+#include "db_iptrie.h"
 #include "ip.h"
 
 extern db_obj *db;
+// Set on replicas and worker processes. The database is only changed by applying the
+// transactions of the primary or by the writer process.
+extern int read_only;
 extern struct master *master;
-extern db_hashmap post_tbl;
-extern db_hashmap ban_tbl;
-extern db_hashmap captcha_tbl;
+extern db_u64map  post_tbl;
+extern db_u64map  captcha_tbl;
+extern db_btree   ban_expiry_idx;   // Bans that expire, by the time they expire
+extern db_btree   report_board_idx; // Reports by board id
+extern db_iptrie  ban_trie;         // Bans by IP range
+extern db_hashmap session_tbl;      // Sessions by sid
 
 int   db_init(const char *file, int create_default);
+// Opens the database of the writer process for reading only, see DB_OPEN_READ_ONLY
+int   db_attach(const char *file);
 char* db_strdup(const char *s);
 void* db_alloc0(size_t size);
 void begin_transaction();
 void commit();
+void flush();
+int  checkpoint_pending();
+void checkpoint();
+void warm_up();
+// Worker processes read the database while the writer keeps changing it. Walks over lists stop
+// early when read_outdated() is set, the page is rendered again after read_end().
+void read_begin();
+void read_end();
+int  read_outdated();
 
 #define get_ptr(type, obj, prop)        ((type)db_unmarshal(db, (obj)->prop))
 #define set_ptr(type, obj, prop, val)   do {(obj)->prop = db_marshal(db, val); \
@@ -48,6 +68,16 @@ struct post;
 struct report;
 struct ban;
 
+// Layout of the database, stored in master->version. Older databases are converted when they
+// are opened.
+// 1: Hash tables with open addressing (db_hashmap)
+// 2: Posts and captchas are found by id in db_u64map tables
+// 3: Hash tables can shrink
+// 4: B+tree indexes of bans by expiry and reports by board
+// 5: Bans are found in a trie of IP ranges instead of ban_tbl
+// 6: Hash table of sessions by sid
+#define DB_VERSION 6
+
 struct master {
 	              uint64 version;
 	/* board* */  db_ptr first_board;
@@ -56,7 +86,7 @@ struct master {
 	              uint64 post_counter;
 	              db_ptr post_tbl;
 	              uint64 last_upload;
-	              db_ptr ban_tbl;
+	              db_ptr ban_tbl; // Only read by upgrade()
 	/* ban* */    db_ptr first_ban;
 	/* ban* */    db_ptr last_ban;
 	              uint64 ban_counter;
@@ -70,6 +100,10 @@ struct master {
 	              db_ptr captcha_tbl;
 	              uint64 captcha_count;
 	/* uint64* */ db_ptr captchas;
+	              db_ptr ban_expiry_idx;
+	              db_ptr report_board_idx;
+	              db_ptr ban_trie;
+	              db_ptr session_tbl;
 };
 
 #define master_new()                    db_new(struct master)
@@ -115,6 +149,14 @@ struct master {
 #define master_set_captcha_count(o,v)   set_val(o, captcha_count, v)
 #define master_captchas(o)              get_ptr(uint64*, o, captchas)
 #define master_set_captchas(o,v)        set_ptr(uint64*, o, captchas, v)
+#define master_ban_expiry_idx(o)        get_val(o, ban_expiry_idx)
+#define master_set_ban_expiry_idx(o,v)  set_val(o, ban_expiry_idx, v)
+#define master_report_board_idx(o)      get_val(o, report_board_idx)
+#define master_set_report_board_idx(o,v) set_val(o, report_board_idx, v)
+#define master_ban_trie(o)              get_val(o, ban_trie)
+#define master_set_ban_trie(o,v)        set_val(o, ban_trie, v)
+#define master_session_tbl(o)           get_val(o, session_tbl)
+#define master_set_session_tbl(o,v)     set_val(o, session_tbl, v)
 
 
 struct board {
@@ -293,6 +335,7 @@ struct report {
 #define report_prev_report(o)           get_ptr(struct report*, o, prev_report)
 #define report_set_prev_report(o,v)     set_ptr(struct report*, o, prev_report, v)
 void report_free(struct report *o);
+void insert_report(struct report *report);
 void delete_report(struct report *report);
 struct report* find_report_by_id(uint64 id);
 
@@ -449,6 +492,8 @@ struct session {
 void session_free(struct session *o);
 
 struct session *find_session_by_sid(const char *sid);
+void insert_session(struct session *session);
+void delete_session(struct session *session);
 
 
 enum ban_type {
@@ -483,7 +528,7 @@ struct ban {
 	/* char* */   db_ptr        mod_name;
 	/* ban* */    db_ptr        next_ban;
 	/* ban* */    db_ptr        prev_ban;
-	/* ban* */    db_ptr        next_in_bucket;
+	/* ban* */    db_ptr        next_in_bucket; // Bans with the same range
 	/* ban* */    db_ptr        prev_in_bucket;
 };
 
@@ -527,6 +572,8 @@ struct ban {
 void ban_free(struct ban *ban);
 
 void insert_ban(struct ban *ban);
+// Call begin_update_ban() before changing a ban and update_ban() afterwards
+void begin_update_ban(struct ban *ban);
 void update_ban(struct ban *ban);
 void delete_ban(struct ban *ban);
 struct ban* find_ban_by_id(uint64 bid);
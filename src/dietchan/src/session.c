@@ -1,8 +1,53 @@
 #include "session.h"
 #include <time.h>
+#include <libowfat/array.h>
 
 #include "print.h"
 
+// Time of the last request of the sessions that were used since the last flush. Writing it to the
+// database for every request would cost a commit per page view, so the writer process keeps it in
+// memory and writes all of them in one transaction every SESSION_FLUSH_INTERVAL seconds.
+// Only a few sessions are active at the same time, a linear search is fast enough.
+struct pending_last_seen {
+	struct session *session;
+	uint64 last_seen;
+};
+
+static array  pending_last_seen;
+static uint64 pending_flush_time;
+
+void (*session_seen_callback)(struct session *session, uint64 time);
+
+static struct pending_last_seen* find_pending(struct session *session)
+{
+	size_t count = array_length(&pending_last_seen, sizeof(struct pending_last_seen));
+	for (size_t i=0; i<count; ++i) {
+		struct pending_last_seen *p = array_get(&pending_last_seen, sizeof(struct pending_last_seen), i);
+		if (p->session == session)
+			return p;
+	}
+	return 0;
+}
+
+static void set_last_seen(struct session *session, uint64 last_seen)
+{
+	struct pending_last_seen *p = find_pending(session);
+	if (!p) {
+		size_t count = array_length(&pending_last_seen, sizeof(struct pending_last_seen));
+		if (count == 0)
+			pending_flush_time = last_seen + SESSION_FLUSH_INTERVAL;
+		p = array_allocate(&pending_last_seen, sizeof(struct pending_last_seen), count);
+		p->session = session;
+	}
+	p->last_seen = last_seen;
+}
+
+static uint64 last_seen(struct session *session)
+{
+	struct pending_last_seen *p = find_pending(session);
+	return p?p->last_seen:session_last_seen(session);
+}
+
 void print_session(http_context *http, struct session *session)
 {
 	if (!session)
@@ -14,9 +59,19 @@ struct session* session_update(struct session *session)
 	if (!session) return 0;
 
 	uint64 t = time(0);
-	uint64 last_seen = session_last_seen(session);
 	int64 timeout = session_timeout(session);
-	if (timeout > 0 && t > last_seen + timeout) {
+
+	// Sessions are only updated and destroyed by the primary's writer process. Elsewhere,
+	// last_seen can be up to SESSION_FLUSH_INTERVAL seconds old.
+	if (read_only) {
+		if (timeout > 0 && t > session_last_seen(session) + timeout)
+			return 0;
+		if (session_seen_callback)
+			session_seen_callback(session, t);
+		return session;
+	}
+
+	if (timeout > 0 && t > last_seen(session) + timeout) {
 		// Expired
 		begin_transaction();
 
@@ -26,22 +81,33 @@ struct session* session_update(struct session *session)
 
 		return 0;
 	} else {
-		begin_transaction();
+		set_last_seen(session, t);
+
+		// FIXME: Update last_ip
 
-		session_set_last_seen(session, t);
+		return session;
+	}
+}
 
-		#if 0
-		// FIXME: Update IP
-		struct ip ip;
-		ip.version = IP_V4; // FIXME: Support IP_V6
-		memcpy(&ip.bytes[0], http->ip, 4);
-		session_set_last_ip(session, ip);
-		#endif
+void session_seen(struct session *session, uint64 time)
+{
+	if (time > last_seen(session))
+		set_last_seen(session, time);
+}
 
-		commit();
+void session_destroy(struct session *session)
+{
+	if (!session)
+		return;
 
-		return session;
+	struct pending_last_seen *p = find_pending(session);
+	if (p) {
+		size_t count = array_length(&pending_last_seen, sizeof(struct pending_last_seen));
+		*p = *(struct pending_last_seen*)array_get(&pending_last_seen, sizeof(struct pending_last_seen), count-1);
+		array_truncate(&pending_last_seen, sizeof(struct pending_last_seen), count-1);
 	}
+
+	delete_session(session);
 }
 
 void purge_expired_sessions()
@@ -50,14 +116,37 @@ void purge_expired_sessions()
 	uint64 t = time(0);
 	begin_transaction();
 	while (session) {
-		uint64 last_seen = session_last_seen(session);
 		int64 timeout = session_timeout(session);
 		struct session *next = session_next_session(session);
 
-		if (timeout > 0 && t >last_seen+timeout)
+		if (timeout > 0 && t > last_seen(session)+timeout)
 			session_destroy(session);
 
 		session = next;
 	}
 	commit();
 }
+
+int64 session_flush_timeout()
+{
+	if (!array_length(&pending_last_seen, sizeof(struct pending_last_seen)))
+		return -1;
+	uint64 now = time(0);
+	return (pending_flush_time <= now)?0:(pending_flush_time - now)*1000;
+}
+
+void session_flush_last_seen()
+{
+	if (session_flush_timeout() != 0)
+		return;
+
+	begin_transaction();
+	size_t count = array_length(&pending_last_seen, sizeof(struct pending_last_seen));
+	for (size_t i=0; i<count; ++i) {
+		struct pending_last_seen *p = array_get(&pending_last_seen, sizeof(struct pending_last_seen), i);
+		session_set_last_seen(p->session, p->last_seen);
+	}
+	array_truncate(&pending_last_seen, sizeof(struct pending_last_seen), 0);
+	commit();
+	flush();
+}
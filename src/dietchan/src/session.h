@@ -5,9 +5,19 @@
 #include "persistence.h"
 
 
+#define SESSION_SID_LENGTH 32
+
 struct session* session_update(struct session *session);
+// Writer: records a use of the session that was reported by a worker process
+void session_seen(struct session *session, uint64 time);
+// Worker processes: passes a use of a session on to the writer
+extern void (*session_seen_callback)(struct session *session, uint64 time);
 void session_destroy(struct session *session);
 void purge_expired_sessions();
+// Milliseconds until the last_seen times of the sessions are due to be written, -1 if there are none
+int64 session_flush_timeout();
+// Writes the last_seen times of the sessions if they are due
+void session_flush_last_seen();
 
 void print_session(http_context *http, struct session *session);
 
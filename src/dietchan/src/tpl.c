@@ -133,7 +133,7 @@ void print_board_bar(http_context *http)
 {
 	struct board *board = master_first_board(master);
 	PRINT(S("<div class='boards'>"));
-	while (board) {
+	while (board && !read_outdated()) {
 		PRINT(S("<span class='board'>"
 		          "<a href='"), S(PREFIX), S("/"), E(board_name(board)), S("/' "
 		             "title='"), E(board_title(board)), S("'>["), E(board_name(board)), S("]"
@@ -606,7 +606,7 @@ void print_post(http_context *http, struct post *post, int absolute_url, int fla
 	int multi_upload = 0;
 	if (up) {
 		PRINT(S("<div class='files"), upload_next_upload(up)?S(" multiple"):S(""), S("'>"));
-		while (up) {
+		while (up && !read_outdated()) {
 			print_upload(http, up);
 			up = upload_next_upload(up);
 		}
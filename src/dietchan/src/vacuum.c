@@ -0,0 +1,183 @@
+#include "vacuum.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include "persistence.h"
+
+// Registers everything that is reachable from the master object with the compaction.
+// Every object must be registered exactly with all of its db_ptr fields, so this has to be kept
+// in sync with persistence.h.
+
+static db_compaction c;
+
+#define visit_ptr(o, prop)  db_compact_pointer(&c, &(o)->prop)
+#define visit_obj(o, prop)  do { visit_ptr(o, prop); db_compact_object(&c, db_unmarshal(db, (o)->prop)); } while (0)
+
+static void visit_upload(struct upload *upload)
+{
+	db_compact_object(&c, upload);
+	visit_obj(upload, file);
+	visit_obj(upload, thumbnail);
+	visit_obj(upload, original_name);
+	visit_obj(upload, mime_type);
+	visit_ptr(upload, next_upload);
+	visit_ptr(upload, prev_upload);
+}
+
+static void visit_post(struct post *post)
+{
+	db_compact_object(&c, post);
+	visit_obj(post, x_forwarded_for);
+	visit_obj(post, useragent);
+	visit_obj(post, username);
+	visit_obj(post, password);
+	visit_obj(post, subject);
+	visit_obj(post, text);
+	visit_obj(post, ban_message);
+	visit_ptr(post, thread);
+	visit_ptr(post, first_upload);
+	visit_ptr(post, last_upload);
+	visit_ptr(post, next_post);
+	visit_ptr(post, prev_post);
+
+	for (struct upload *upload=post_first_upload(post); upload; upload=upload_next_upload(upload))
+		visit_upload(upload);
+}
+
+static void visit_thread(struct thread *thread)
+{
+	db_compact_object(&c, thread);
+	visit_ptr(thread, board);
+	visit_ptr(thread, first_post);
+	visit_ptr(thread, last_post);
+	visit_ptr(thread, next_thread);
+	visit_ptr(thread, prev_thread);
+
+	for (struct post *post=thread_first_post(thread); post; post=post_next_post(post))
+		visit_post(post);
+}
+
+static void visit_board(struct board *board)
+{
+	db_compact_object(&c, board);
+	visit_obj(board, name);
+	visit_obj(board, title);
+	visit_ptr(board, first_thread);
+	visit_ptr(board, last_thread);
+	visit_ptr(board, next_board);
+	visit_ptr(board, prev_board);
+
+	for (struct thread *thread=board_first_thread(board); thread; thread=thread_next_thread(thread))
+		visit_thread(thread);
+}
+
+static void visit_ban(struct ban *ban)
+{
+	db_compact_object(&c, ban);
+	visit_obj(ban, boards);
+	visit_obj(ban, reason);
+	visit_obj(ban, mod_name);
+	visit_ptr(ban, next_ban);
+	visit_ptr(ban, prev_ban);
+	visit_ptr(ban, next_in_bucket);
+	visit_ptr(ban, prev_in_bucket);
+}
+
+static void visit_report(struct report *report)
+{
+	db_compact_object(&c, report);
+	visit_obj(report, comment);
+	visit_ptr(report, next_report);
+	visit_ptr(report, prev_report);
+}
+
+static void visit_user(struct user *user)
+{
+	db_compact_object(&c, user);
+	visit_obj(user, name);
+	visit_obj(user, password);
+	visit_obj(user, email);
+	visit_obj(user, boards);
+	visit_ptr(user, next_user);
+	visit_ptr(user, prev_user);
+}
+
+static void visit_session(struct session *session)
+{
+	db_compact_object(&c, session);
+	visit_obj(session, sid);
+	visit_ptr(session, next_session);
+	visit_ptr(session, prev_session);
+}
+
+static void visit_captcha(struct captcha *captcha)
+{
+	db_compact_object(&c, captcha);
+	visit_obj(captcha, solution);
+}
+
+static void visit_master()
+{
+	db_compact_object(&c, master);
+	visit_ptr(master, first_board);
+	visit_ptr(master, last_board);
+	visit_ptr(master, post_tbl);
+	visit_ptr(master, ban_tbl);
+	visit_ptr(master, first_ban);
+	visit_ptr(master, last_ban);
+	visit_ptr(master, first_report);
+	visit_ptr(master, last_report);
+	visit_ptr(master, first_user);
+	visit_ptr(master, last_user);
+	visit_ptr(master, first_session);
+	visit_ptr(master, captcha_tbl);
+	visit_obj(master, captchas);
+	visit_ptr(master, ban_expiry_idx);
+	visit_ptr(master, report_board_idx);
+	visit_ptr(master, ban_trie);
+	visit_ptr(master, session_tbl);
+
+	for (struct board *board=master_first_board(master); board; board=board_next_board(board))
+		visit_board(board);
+	for (struct ban *ban=master_first_ban(master); ban; ban=ban_next_ban(ban))
+		visit_ban(ban);
+	for (struct report *report=master_first_report(master); report; report=report_next_report(report))
+		visit_report(report);
+	for (struct user *user=master_first_user(master); user; user=user_next_user(user))
+		visit_user(user);
+	for (struct session *session=master_first_session(master); session; session=session_next_session(session))
+		visit_session(session);
+
+	// Captchas are only reachable through their table
+	for (uint64 i=0; i<master_captcha_count(master); ++i)
+		visit_captcha(find_captcha_by_id(master_captchas(master)[i]));
+
+	db_u64map_compact(&post_tbl, &c);
+	db_u64map_compact(&captcha_tbl, &c);
+	db_btree_compact(&ban_expiry_idx, &c);
+	db_btree_compact(&report_board_idx, &c);
+	db_iptrie_compact(&ban_trie, &c);
+	db_hashmap_compact(&session_tbl, &c);
+}
+
+int vacuum()
+{
+	off_t size_before = lseek(db->fd, 0, SEEK_END);
+
+	db_compact_begin(db, &c);
+
+	// Finishing the hashmap resizes changes the database
+	begin_transaction();
+	visit_master();
+	commit();
+	flush();
+
+	if (db_compact_finish(&c) < 0) {
+		fprintf(stderr, "Vacuum failed, the database was not changed.\n");
+		return -1;
+	}
+
+	off_t size_after = lseek(db->fd, 0, SEEK_END);
+	printf("Database size: %lld -> %lld bytes\n", (long long)size_before, (long long)size_after);
+	return 0;
+}
@@ -0,0 +1,6 @@
+#ifndef VACUUM_H
+#define VACUUM_H
+
+int vacuum();
+
+#endif // VACUUM_H